@@ -0,0 +1,353 @@
+// Host-side benchmark of the Shelly Dimmer protocol paths: the command transport against an emulated STM32
+// application firmware, and stm32flash against an emulated system bootloader. Link timing runs on a simulated clock,
+// so the reported bus figures are reproducible; host CPU figures are measured in wall clock time.
+
+#include "mock_uart.h"
+#include "sim_clock.h"
+#include "stm32_emulator.h"
+
+#include "../components/shelly_dimmer/calibration.h"
+#include "../components/shelly_dimmer/stm32flash.h"
+#include "../components/shelly_dimmer/transport.h"
+#include "esphome/core/log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+namespace shd = esphome::shelly_dimmer;
+
+struct Options {
+  uint32_t baud_rate{115200};
+  uint32_t dfu_baud_rate{115200};
+  uint32_t latency_us{1000};
+  double byte_error_rate{0.0};
+  uint32_t commands{2000};
+  // Not a whole number of words, like most firmware images: the last word is padded with erased flash.
+  uint32_t image_size{16 * 1024 - 3};
+  // ESPHome's default loop interval, and the time other components take per loop with high frequency looping.
+  uint32_t loop_interval_us{16000};
+  uint32_t busy_loop_us{200};
+  uint32_t seed{1};
+  bool quick{false};
+};
+
+bool failed = false;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+void check(bool condition, const char *what) {
+  if (!condition) {
+    std::printf("  FAILED: %s\n", what);
+    failed = true;
+  }
+}
+
+double seconds(uint64_t us) { return us / 1e6; }
+
+uint64_t percentile(std::vector<uint64_t> values, uint32_t percent) {
+  if (values.empty()) {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  const size_t rank = (values.size() * percent + 99) / 100;
+  return values[std::max<size_t>(rank, 1) - 1];
+}
+
+template<typename F> double wall_clock_us(F &&f) {
+  const auto start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// Alternating POLL and SWITCH commands, kept two deep like a dimmer that is sampling while being dimmed.
+void bench_transport(const Options &options, double byte_error_rate) {
+  std::printf("transport: %u commands at %u baud, %u us latency, byte error rate %g, loop every %u us\n",
+              options.commands, options.baud_rate, options.latency_us, byte_error_rate, options.loop_interval_us);
+  bench::reset_clock();
+
+  bench::LinkConfig config{options.baud_rate, options.latency_us, byte_error_rate, options.seed};
+  bench::MockUart uart(config);
+  bench::FirmwareEmulator firmware(&uart, USE_SHD_FIRMWARE_MAJOR_VERSION, USE_SHD_FIRMWARE_MINOR_VERSION);
+  uart.attach(&firmware);
+  esphome::uart::UARTDevice device(&uart);
+
+  // Same acceptance rules as ShellyDimmer::handle_frame_().
+  shd::ShellyTransport transport(&device, [](uint8_t cmd, const uint8_t *payload, uint8_t len) {
+    switch (cmd) {
+      case shd::SHELLY_DIMMER_PROTO_CMD_POLL:
+        return len >= 16;
+      case shd::SHELLY_DIMMER_PROTO_CMD_VERSION:
+        return len >= 2;
+      case shd::SHELLY_DIMMER_PROTO_CMD_SWITCH:
+      case shd::SHELLY_DIMMER_PROTO_CMD_SETTINGS:
+        return len >= 1 && payload[0] == 0x01;
+      default:
+        return false;
+    }
+  });
+
+  uint32_t issued = 0;
+  uint32_t completed = 0;
+  uint32_t succeeded = 0;
+  std::vector<uint64_t> latencies;
+  const uint64_t start = bench::now_us();
+  while (completed < options.commands) {
+    while (issued - completed < 2 && issued < options.commands) {
+      const uint64_t queued = bench::now_us();
+      auto on_complete = [&, queued](bool success) {
+        completed++;
+        if (success) {
+          succeeded++;
+          latencies.push_back(bench::now_us() - queued);
+        }
+      };
+      bool accepted;
+      if (issued % 2 == 0) {
+        accepted = transport.send_command(shd::SHELLY_DIMMER_PROTO_CMD_POLL, nullptr, 0, on_complete);
+      } else {
+        const uint16_t brightness = issued % 1000;
+        const uint8_t payload[] = {static_cast<uint8_t>(brightness), static_cast<uint8_t>(brightness >> 8)};
+        accepted = transport.send_command(shd::SHELLY_DIMMER_PROTO_CMD_SWITCH, payload, sizeof(payload), on_complete);
+      }
+      check(accepted, "command queued");
+      if (!accepted) {
+        return;
+      }
+      issued++;
+    }
+    transport.loop();
+    bench::advance_us(options.loop_interval_us);
+  }
+  const uint64_t elapsed = bench::now_us() - start;
+
+  uint64_t latency_sum = 0;
+  for (uint64_t latency : latencies) {
+    latency_sum += latency;
+  }
+  const shd::ShellyTransport::LinkStats &stats = transport.stats();
+  std::printf("  %u/%u acked in %.3f s: %.1f commands/s\n", succeeded, options.commands, seconds(elapsed),
+              succeeded / seconds(elapsed));
+  std::printf("  ack latency: mean %.2f ms, p50 %.2f ms, p95 %.2f ms, max %.2f ms (transport p95 %u ms)\n",
+              latencies.empty() ? 0.0 : latency_sum / 1000.0 / latencies.size(), percentile(latencies, 50) / 1000.0,
+              percentile(latencies, 95) / 1000.0, percentile(latencies, 100) / 1000.0,
+              transport.ack_latency_percentile(95));
+  std::printf("  frames %u, retries %u, timeouts %u, checksum errors %u, framing errors %u, corrupted bytes %u\n",
+              stats.frames_sent, stats.retries, stats.timeouts, stats.checksum_errors, stats.framing_errors,
+              uart.corrupted_bytes());
+  if (byte_error_rate == 0.0) {
+    check(succeeded == options.commands, "every command acked on a clean link");
+  }
+}
+
+/// The image as it ends up in flash, its last word padded with erased flash.
+std::vector<uint8_t> pad_to_words(std::vector<uint8_t> image) {
+  image.resize((image.size() + 3) & ~size_t{3}, 0xFF);
+  return image;
+}
+
+/// One firmware upgrade pass over the emulated bootloader: init, mass erase, write, CRC.
+/// The CRC comes from GET CHECKSUM when the bootloader has it, otherwise from READ and stm32_sw_crc.
+void bench_flash(const Options &options, const std::vector<uint8_t> &image, bool incremental, bool crc_command) {
+  std::printf("flash: %zu byte image at %u baud, %s write, CRC via %s\n", image.size(), options.dfu_baud_rate,
+              incremental ? "incremental PROGMEM" : "blocking stream", crc_command ? "GET CHECKSUM" : "READ");
+  bench::reset_clock();
+
+  bench::LinkConfig config{options.dfu_baud_rate, options.latency_us, 0.0, options.seed};
+  bench::MockUart uart(config);
+  bench::BootloaderEmulator bootloader(&uart, bench::FlashTiming{}, crc_command);
+  uart.attach(&bootloader);
+  esphome::uart::UARTDevice device(&uart);
+
+  const shd::stm32_unique_ptr stm = shd::stm32_init(&device, shd::STREAM_SERIAL, 1);
+  check(stm != nullptr, "bootloader initialized");
+  if (!stm) {
+    return;
+  }
+  const uint32_t address = stm->dev->fl_start;
+  const uint64_t init_done = bench::now_us();
+
+  check(shd::stm32_erase_memory(stm, 0, shd::STM32_MASS_ERASE) == shd::STM32_ERR_OK, "mass erase");
+  const uint64_t erase_done = bench::now_us();
+
+  shd::stm32_err_t err;
+  uint64_t longest_call = 0;
+  uint32_t loops = 0;
+  if (incremental) {
+    // Like the upgrade in loop(): other components run between polls.
+    shd::stm32_write_t write;
+    uint64_t call_start = bench::now_us();
+    err = shd::stm32_write_start_progmem(stm, write, address, image.data(), image.size());
+    while (true) {
+      longest_call = std::max(longest_call, bench::now_us() - call_start);
+      if (err != shd::STM32_ERR_PENDING) {
+        break;
+      }
+      bench::advance_us(options.busy_loop_us);
+      loops++;
+      call_start = bench::now_us();
+      err = shd::stm32_write_poll(stm, write);
+    }
+  } else {
+    const auto source = [&image](uint32_t offset, uint8_t *buf, unsigned int len) {
+      std::memcpy(buf, image.data() + offset, len);
+      return true;
+    };
+    err = shd::stm32_write_stream(stm, address, source, image.size());
+    longest_call = bench::now_us() - erase_done;
+    loops = 1;
+  }
+  check(err == shd::STM32_ERR_OK, "write");
+  const uint64_t write_done = bench::now_us();
+  check(std::equal(image.begin(), image.end(), bootloader.flash().begin()), "flash matches the image");
+
+  const std::vector<uint8_t> padded = pad_to_words(image);
+  uint32_t crc = 0;
+  check(shd::stm32_crc_wrapper(stm, address, padded.size(), &crc) == shd::STM32_ERR_OK, "CRC readback");
+  const uint64_t crc_done = bench::now_us();
+  check(bootloader.crc_requests() == (crc_command ? 1u : 0u), "CRC computed by the expected side");
+  check(crc == bench::reference_crc(padded.data(), padded.size()), "CRC matches the bitwise reference");
+
+  const uint64_t write_time = write_done - erase_done;
+  std::printf("  init %.3f s, erase %.3f s, write %.3f s (%.1f KiB/s), total upload %.3f s\n", seconds(init_done),
+              seconds(erase_done - init_done), seconds(write_time), image.size() / 1024.0 / seconds(write_time),
+              seconds(write_done));
+  std::printf("  longest blocking call %.2f ms over %u loop iterations\n", longest_call / 1000.0, loops);
+  std::printf("  CRC readback %.3f s (%.1f KiB/s)\n", seconds(crc_done - write_done),
+              padded.size() / 1024.0 / seconds(crc_done - write_done));
+}
+
+/// Host CPU cost of the software CRC and of rebuilding the brightness table from a calibration.
+void bench_cpu(const Options &options, const std::vector<uint8_t> &unpadded) {
+  std::printf("cpu (host wall clock)\n");
+
+  std::vector<uint8_t> image = pad_to_words(unpadded);
+  check(shd::stm32_sw_crc(0xFFFFFFFF, image.data(), image.size()) == bench::reference_crc(image.data(), image.size()),
+        "table CRC matches the bitwise reference");
+
+  const uint32_t rounds = options.quick ? 64 : 1024;
+  uint32_t crc = 0xFFFFFFFF;
+  const double crc_us = wall_clock_us([&] {
+    for (uint32_t i = 0; i < rounds; i++) {
+      crc = shd::stm32_sw_crc(crc, image.data(), image.size());
+    }
+  });
+  std::printf("  stm32_sw_crc: %.1f MiB/s (crc %08x)\n", rounds * image.size() / crc_us * 1e6 / (1024 * 1024), crc);
+
+  constexpr size_t STEPS = 32;
+  constexpr size_t TABLE_SIZE = 1001;
+  std::mt19937 rng(options.seed);
+  std::uniform_real_distribution<float> noise(-0.02f, 0.02f);
+  std::vector<float> table(TABLE_SIZE);
+  const uint32_t fits = options.quick ? 100 : 2000;
+  const double fit_us = wall_clock_us([&] {
+    for (uint32_t i = 0; i < fits; i++) {
+      // A noisy, roughly quadratic power curve, measured from full brightness down like a calibration run.
+      std::array<float, STEPS> power;
+      for (size_t step = 0; step < STEPS; step++) {
+        const float brightness = 1.0f - step / float(STEPS);
+        power[step] = brightness * brightness + noise(rng);
+      }
+      // Same steps as ShellyDimmer::complete_calibration_() and rebuild_brightness_table_().
+      shd::pool_adjacent_violators(power.data(), STEPS);
+      const float max = power[0];
+      const float min = power[STEPS - 1];
+      shd::MonotoneSpline<STEPS> spline;
+      for (int step = STEPS - 1; step >= 0; step--) {
+        spline.add((power[step] - min) / (max - min), 1.0f - step / float(STEPS));
+      }
+      spline.fit();
+      for (size_t j = 0; j < TABLE_SIZE; j++) {
+        table[j] = spline.evaluate(j / float(TABLE_SIZE - 1));
+      }
+    }
+  });
+  check(std::is_sorted(table.begin(), table.end()), "brightness table is monotone");
+  std::printf("  calibration fit + %zu point table: %.1f us\n", TABLE_SIZE, fit_us / fits);
+}
+
+/// Resuming a calibration interrupted by a reboot, against the configured step count.
+void bench_calibration_resume() {
+  std::printf("calibration resume\n");
+  using shd::CalibrationResume;
+  check(shd::calibration_resume_action(20, 0, 20) == CalibrationResume::NONE, "finished curve is not resumed");
+  check(shd::calibration_resume_action(20, 7, 20) == CalibrationResume::CONTINUE, "matching run continues");
+  check(shd::calibration_resume_action(20, 7, 16) == CalibrationResume::DISCARD,
+        "run with fewer configured steps is discarded");
+  check(shd::calibration_resume_action(16, 7, 20) == CalibrationResume::DISCARD,
+        "run with more configured steps is discarded");
+  check(shd::calibration_resume_action(20, 20, 20) == CalibrationResume::DISCARD,
+        "run past its last step is discarded");
+}
+
+void usage(const char *name) {
+  std::printf("usage: %s [--quick] [--baud N] [--dfu-baud N] [--latency-us N] [--error-rate P] [--commands N]\n"
+              "       [--image-size N] [--loop-interval-us N] [--busy-loop-us N] [--seed N] [--log-level N]\n",
+              name);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--quick") {
+      options.quick = true;
+      options.commands = 200;
+      options.image_size = 4 * 1024 - 3;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 2;
+    }
+    const char *value = argv[++i];
+    if (arg == "--baud") {
+      options.baud_rate = std::strtoul(value, nullptr, 0);
+    } else if (arg == "--dfu-baud") {
+      options.dfu_baud_rate = std::strtoul(value, nullptr, 0);
+    } else if (arg == "--latency-us") {
+      options.latency_us = std::strtoul(value, nullptr, 0);
+    } else if (arg == "--error-rate") {
+      options.byte_error_rate = std::strtod(value, nullptr);
+    } else if (arg == "--commands") {
+      options.commands = std::strtoul(value, nullptr, 0);
+    } else if (arg == "--image-size") {
+      options.image_size = std::strtoul(value, nullptr, 0);
+    } else if (arg == "--loop-interval-us") {
+      options.loop_interval_us = std::strtoul(value, nullptr, 0);
+    } else if (arg == "--busy-loop-us") {
+      options.busy_loop_us = std::strtoul(value, nullptr, 0);
+    } else if (arg == "--seed") {
+      options.seed = std::strtoul(value, nullptr, 0);
+    } else if (arg == "--log-level") {
+      bench::set_log_level(std::atoi(value));
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  bench_transport(options, options.byte_error_rate);
+  if (options.byte_error_rate == 0.0) {
+    // Retries and resynchronization on a noisy link.
+    bench_transport(options, 0.01);
+  }
+
+  std::mt19937 rng(options.seed);
+  std::vector<uint8_t> image(options.image_size);
+  std::generate(image.begin(), image.end(), [&rng] { return static_cast<uint8_t>(rng()); });
+  bench_flash(options, image, true, false);
+  bench_flash(options, image, false, true);
+  bench_cpu(options, image);
+  bench_calibration_resume();
+
+  std::printf(failed ? "FAILED\n" : "OK\n");
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,88 @@
+#include "mock_uart.h"
+#include "sim_clock.h"
+
+#include <algorithm>
+
+namespace bench {
+
+MockUart::MockUart(const LinkConfig &config) : config_(config), rng_(config.seed) {}
+
+uint64_t MockUart::byte_time_us() const {
+  // 8N1: start bit, 8 data bits and a stop bit, rounded up.
+  return (10 * 1000000ULL + this->config_.baud_rate - 1) / this->config_.baud_rate;
+}
+
+uint8_t MockUart::corrupt_(uint8_t byte) {
+  if (this->config_.byte_error_rate <= 0.0 || this->error_dist_(this->rng_) >= this->config_.byte_error_rate) {
+    return byte;
+  }
+  this->corrupted_bytes_++;
+  return byte ^ static_cast<uint8_t>(1U << (this->rng_() % 8));
+}
+
+void MockUart::send(const uint8_t *data, size_t len, uint64_t time_us) {
+  const uint64_t byte_time = this->byte_time_us();
+  uint64_t start = std::max(time_us, this->rx_free_us_);
+  for (size_t i = 0; i < len; i++) {
+    start += byte_time;
+    this->rx_.emplace_back(start, this->corrupt_(data[i]));
+  }
+  this->rx_free_us_ = start;
+}
+
+void MockUart::clear() {
+  this->rx_.clear();
+  this->rx_free_us_ = now_us();
+}
+
+void MockUart::write_array(const uint8_t *data, size_t len) {
+  const uint64_t byte_time = this->byte_time_us();
+  for (size_t i = 0; i < len; i++) {
+    // Block while the FIFO is full.
+    const uint64_t fifo_time = TX_FIFO_SIZE * byte_time;
+    if (this->tx_free_us_ > now_us() + fifo_time) {
+      advance_to_us(this->tx_free_us_ - fifo_time);
+    }
+
+    const uint64_t done = std::max(now_us(), this->tx_free_us_) + byte_time;
+    this->tx_free_us_ = done;
+    const uint8_t byte = this->corrupt_(data[i]);
+    if (this->peer_ != nullptr) {
+      this->peer_->receive(byte, done);
+    }
+  }
+}
+
+int MockUart::available() {
+  const uint64_t now = now_us();
+  const auto end = std::find_if(this->rx_.begin(), this->rx_.end(),
+                                [now](const std::pair<uint64_t, uint8_t> &entry) { return entry.first > now; });
+  return static_cast<int>(end - this->rx_.begin());
+}
+
+bool MockUart::peek_byte(uint8_t *data) {
+  if (this->available() == 0) {
+    return false;
+  }
+  *data = this->rx_.front().second;
+  return true;
+}
+
+bool MockUart::read_array(uint8_t *data, size_t len) {
+  // Skip ahead to the arrival of the last byte needed, unless it comes too late.
+  const uint64_t deadline = now_us() + READ_TIMEOUT_US;
+  if (this->rx_.size() < len || this->rx_[len - 1].first > deadline) {
+    advance_to_us(deadline);
+    return false;
+  }
+  advance_to_us(this->rx_[len - 1].first);
+  for (size_t i = 0; i < len; i++) {
+    data[i] = this->rx_.front().second;
+    this->rx_.pop_front();
+  }
+  return true;
+}
+
+void MockUart::flush() { advance_to_us(this->tx_free_us_); }
+
+}  // namespace bench
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "esphome/components/uart/uart.h"
+
+#include <cstdint>
+#include <deque>
+#include <random>
+#include <utility>
+
+namespace bench {
+
+/// Electrical and timing properties of the simulated link.
+struct LinkConfig {
+  uint32_t baud_rate{115200};
+  // Time the STM32 takes to start answering once a request is complete.
+  uint32_t latency_us{1000};
+  // Chance of a bit flip per byte, applied in both directions.
+  double byte_error_rate{0.0};
+  uint32_t seed{1};
+};
+
+/// The emulated STM32 on the other end of the link.
+class Peer {
+ public:
+  virtual ~Peer() = default;
+
+  /// A byte sent by the host has been received completely at the given time.
+  virtual void receive(uint8_t byte, uint64_t time_us) = 0;
+};
+
+/// UART bus between the code under test and an emulated STM32, timed by the simulated clock.
+///
+/// Bytes take 10 bit times on the wire in either direction. Writes only block while the ESP8266's TX FIFO is full,
+/// reads wait for data like the ESPHome UART does.
+class MockUart : public esphome::uart::UARTComponent {
+ public:
+  explicit MockUart(const LinkConfig &config);
+
+  void attach(Peer *peer) { this->peer_ = peer; }
+
+  /// Queues bytes towards the host, the first one going on the wire no earlier than time_us.
+  void send(const uint8_t *data, size_t len, uint64_t time_us);
+
+  /// Drops everything in flight towards the host, e.g. when the STM32 is reset.
+  void clear();
+
+  uint32_t get_baud_rate() const { return this->config_.baud_rate; }
+  void set_baud_rate(uint32_t baud_rate) { this->config_.baud_rate = baud_rate; }
+  const LinkConfig &config() const { return this->config_; }
+
+  /// Time a single byte takes on the wire.
+  uint64_t byte_time_us() const;
+
+  uint32_t corrupted_bytes() const { return this->corrupted_bytes_; }
+
+  // UARTComponent
+  void write_array(const uint8_t *data, size_t len) override;
+  bool peek_byte(uint8_t *data) override;
+  bool read_array(uint8_t *data, size_t len) override;
+  int available() override;
+  void flush() override;
+
+ protected:
+  static constexpr size_t TX_FIFO_SIZE = 128;
+  // ESPHome's UART read timeout.
+  static constexpr uint64_t READ_TIMEOUT_US = 100 * 1000;
+
+  /// Applies the configured byte error rate.
+  uint8_t corrupt_(uint8_t byte);
+
+  LinkConfig config_;
+  Peer *peer_{nullptr};
+  std::mt19937 rng_;
+  std::uniform_real_distribution<double> error_dist_{0.0, 1.0};
+  uint32_t corrupted_bytes_{0};
+  // When the wire in either direction is free again.
+  uint64_t tx_free_us_{0};
+  uint64_t rx_free_us_{0};
+  // Bytes towards the host with the time they have been received completely.
+  std::deque<std::pair<uint64_t, uint8_t>> rx_;
+};
+
+}  // namespace bench
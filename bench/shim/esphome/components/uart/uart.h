@@ -0,0 +1,53 @@
+#pragma once
+
+#include "esphome/core/hal.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace uart {
+
+/// The bus side of a UART, implemented by the mock in mock_uart.h.
+class UARTComponent {
+ public:
+  virtual ~UARTComponent() = default;
+
+  virtual void write_array(const uint8_t *data, size_t len) = 0;
+  virtual bool peek_byte(uint8_t *data) = 0;
+  /// Waits for len bytes like the ESPHome UART does, giving up after its read timeout.
+  virtual bool read_array(uint8_t *data, size_t len) = 0;
+  virtual int available() = 0;
+  /// Blocks until all written bytes are on the wire.
+  virtual void flush() = 0;
+};
+
+/// Same interface as the ESPHome UARTDevice, forwarding to its bus.
+class UARTDevice {
+ public:
+  UARTDevice() = default;
+  explicit UARTDevice(UARTComponent *parent) : parent_(parent) {}
+
+  void set_uart_parent(UARTComponent *parent) { this->parent_ = parent; }
+
+  void write_byte(uint8_t data) { this->parent_->write_array(&data, 1); }
+  void write_array(const uint8_t *data, size_t len) { this->parent_->write_array(data, len); }
+  bool read_byte(uint8_t *data) { return this->parent_->read_array(data, 1); }
+  bool peek_byte(uint8_t *data) { return this->parent_->peek_byte(data); }
+  bool read_array(uint8_t *data, size_t len) { return this->parent_->read_array(data, len); }
+  int available() { return this->parent_->available(); }
+  void flush() { this->parent_->flush(); }
+
+  int read() {
+    uint8_t data;
+    if (!this->read_byte(&data))
+      return -1;
+    return data;
+  }
+
+ protected:
+  UARTComponent *parent_{nullptr};
+};
+
+}  // namespace uart
+}  // namespace esphome
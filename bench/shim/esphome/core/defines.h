@@ -0,0 +1,7 @@
+#pragma once
+
+// Host build of the shared sources: the flasher is always compiled in, trimmed to the Shelly Dimmer's STM32F031.
+#define USE_SHD_FIRMWARE_DATA
+#define USE_SHD_DEVICE_IDS 0x444
+#define USE_SHD_FIRMWARE_MAJOR_VERSION 51
+#define USE_SHD_FIRMWARE_MINOR_VERSION 6
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// Data lives in regular memory on the host.
+#define PROGMEM
+#define pgm_read_byte(addr) (*reinterpret_cast<const uint8_t *>(addr))
+#define pgm_read_dword(addr) \
+  ([](const void *p) { \
+    uint32_t v; \
+    std::memcpy(&v, p, sizeof(v)); \
+    return v; \
+  }(addr))
+
+namespace esphome {
+
+// Backed by the simulated clock, see sim_clock.h.
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+}  // namespace esphome
@@ -0,0 +1,31 @@
+#pragma once
+
+#define ESPHOME_LOG_LEVEL_NONE 0
+#define ESPHOME_LOG_LEVEL_ERROR 1
+#define ESPHOME_LOG_LEVEL_WARN 2
+#define ESPHOME_LOG_LEVEL_INFO 3
+#define ESPHOME_LOG_LEVEL_CONFIG 4
+#define ESPHOME_LOG_LEVEL_DEBUG 5
+#define ESPHOME_LOG_LEVEL_VERBOSE 6
+#define ESPHOME_LOG_LEVEL_VERY_VERBOSE 7
+
+#ifndef ESPHOME_LOG_LEVEL
+#define ESPHOME_LOG_LEVEL ESPHOME_LOG_LEVEL_DEBUG
+#endif
+
+namespace esphome {
+
+/// Prints the message when level is within the level selected on the command line.
+void esp_log_printf_(int level, const char *tag, int line, const char *format, ...)  // NOLINT
+    __attribute__((format(printf, 4, 5)));
+
+}  // namespace esphome
+
+#define ESP_LOG_(level, tag, ...) ::esphome::esp_log_printf_(level, tag, __LINE__, __VA_ARGS__)
+#define ESP_LOGE(tag, ...) ESP_LOG_(ESPHOME_LOG_LEVEL_ERROR, tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) ESP_LOG_(ESPHOME_LOG_LEVEL_WARN, tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) ESP_LOG_(ESPHOME_LOG_LEVEL_INFO, tag, __VA_ARGS__)
+#define ESP_LOGCONFIG(tag, ...) ESP_LOG_(ESPHOME_LOG_LEVEL_CONFIG, tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) ESP_LOG_(ESPHOME_LOG_LEVEL_DEBUG, tag, __VA_ARGS__)
+#define ESP_LOGV(tag, ...) ESP_LOG_(ESPHOME_LOG_LEVEL_VERBOSE, tag, __VA_ARGS__)
+#define ESP_LOGVV(tag, ...) ESP_LOG_(ESPHOME_LOG_LEVEL_VERY_VERBOSE, tag, __VA_ARGS__)
@@ -0,0 +1,53 @@
+#include "sim_clock.h"
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+#include <cstdarg>
+#include <cstdio>
+
+namespace bench {
+
+namespace {
+
+uint64_t clock_us = 0;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+int log_level = ESPHOME_LOG_LEVEL_ERROR;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+}  // namespace
+
+uint64_t now_us() { return clock_us; }
+
+void advance_us(uint64_t us) { clock_us += us; }
+
+void advance_to_us(uint64_t time_us) {
+  if (time_us > clock_us) {
+    clock_us = time_us;
+  }
+}
+
+void reset_clock() { clock_us = 0; }
+
+void set_log_level(int level) { log_level = level; }
+
+}  // namespace bench
+
+namespace esphome {
+
+uint32_t millis() { return static_cast<uint32_t>(bench::now_us() / 1000); }
+uint32_t micros() { return static_cast<uint32_t>(bench::now_us()); }
+void delay(uint32_t ms) { bench::advance_us(uint64_t{ms} * 1000); }
+void delayMicroseconds(uint32_t us) { bench::advance_us(us); }
+void yield() { bench::advance_us(bench::YIELD_US); }
+
+void esp_log_printf_(int level, const char *tag, int line, const char *format, ...) {  // NOLINT
+  if (level > bench::log_level) {
+    return;
+  }
+  std::printf("[%10.3f][%s:%d]: ", bench::now_us() / 1000.0, tag, line);
+  va_list args;
+  va_start(args, format);
+  std::vprintf(format, args);
+  va_end(args);
+  std::printf("\n");
+}
+
+}  // namespace esphome
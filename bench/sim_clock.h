@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+
+namespace bench {
+
+/// Simulated time in µs. millis(), delay() and yield() of the shim run on it, so results do not depend on the host.
+uint64_t now_us();
+void advance_us(uint64_t us);
+/// Advances to the given time, unless it already passed.
+void advance_to_us(uint64_t time_us);
+void reset_clock();
+
+/// Simulated CPU time a yield() takes, i.e. the granularity of busy waits.
+constexpr uint64_t YIELD_US = 5;
+
+/// Only messages at or below this level are printed.
+void set_log_level(int level);
+
+}  // namespace bench
@@ -0,0 +1,368 @@
+#include "stm32_emulator.h"
+#include "../components/shelly_dimmer/transport.h"
+
+#include <algorithm>
+
+using esphome::shelly_dimmer::shelly_dimmer_checksum;
+
+namespace bench {
+
+namespace {
+
+constexpr uint8_t PROTO_START_BYTE = 0x01;
+constexpr uint8_t PROTO_END_BYTE = 0x04;
+// A partial frame is dropped when the line stays idle this long, e.g. after a corrupted length byte.
+constexpr uint64_t FRAME_IDLE_TIMEOUT_US = 5000;
+
+constexpr uint8_t BL_ACK = 0x79;
+constexpr uint8_t BL_NACK = 0x1F;
+constexpr uint8_t BL_INIT = 0x7F;
+constexpr uint8_t BL_VERSION = 0x31;
+constexpr uint8_t BL_GET = 0x00;
+constexpr uint8_t BL_GVR = 0x01;
+constexpr uint8_t BL_GID = 0x02;
+constexpr uint8_t BL_READ = 0x11;
+constexpr uint8_t BL_GO = 0x21;
+constexpr uint8_t BL_WRITE = 0x31;
+constexpr uint8_t BL_EXTENDED_ERASE = 0x44;
+constexpr uint8_t BL_CRC = 0xA1;
+constexpr uint16_t BL_PID = 0x444;
+
+uint8_t xor_of(const uint8_t *data, size_t len) {
+  uint8_t x = 0;
+  for (size_t i = 0; i < len; i++) {
+    x ^= data[i];
+  }
+  return x;
+}
+
+}  // namespace
+
+uint32_t reference_crc(const uint8_t *data, size_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i + 4 <= len; i += 4) {
+    crc ^= data[i] | data[i + 1] << 8 | data[i + 2] << 16 | static_cast<uint32_t>(data[i + 3]) << 24;
+    for (int bit = 0; bit < 32; bit++) {
+      crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+FirmwareEmulator::FirmwareEmulator(MockUart *uart, uint8_t major, uint8_t minor)
+    : uart_(uart), major_(major), minor_(minor) {}
+
+void FirmwareEmulator::receive(uint8_t byte, uint64_t time_us) {
+  if (!this->frame_.empty() && time_us - this->last_byte_us_ > FRAME_IDLE_TIMEOUT_US) {
+    this->frames_dropped_++;
+    this->frame_.clear();
+  }
+  this->last_byte_us_ = time_us;
+  if (this->frame_.empty() && byte != PROTO_START_BYTE) {
+    this->frames_dropped_++;
+    return;
+  }
+  this->frame_.push_back(byte);
+  if (this->frame_.size() < 4 || this->frame_.size() < 4 + this->frame_[3] + 3u) {
+    return;
+  }
+
+  const uint8_t len = this->frame_[3];
+  const uint16_t csum = shelly_dimmer_checksum(&this->frame_[1], 3 + len);
+  const bool valid = this->frame_[4 + len] == (csum >> 8) && this->frame_[5 + len] == (csum & 0xFF) &&
+                     this->frame_[6 + len] == PROTO_END_BYTE;
+  if (valid) {
+    this->frames_received_++;
+    this->reply_(time_us);
+  } else {
+    this->frames_dropped_++;
+  }
+  this->frame_.clear();
+}
+
+void FirmwareEmulator::reply_(uint64_t time_us) {
+  const uint8_t seq = this->frame_[1];
+  const uint8_t cmd = this->frame_[2];
+  const uint8_t *payload = &this->frame_[4];
+  const uint8_t len = this->frame_[3];
+
+  std::vector<uint8_t> data;
+  switch (cmd) {
+    case esphome::shelly_dimmer::SHELLY_DIMMER_PROTO_CMD_SWITCH:
+      if (len >= 2) {
+        this->brightness_ = payload[0] | payload[1] << 8;
+      }
+      data = {0x01};
+      break;
+    case esphome::shelly_dimmer::SHELLY_DIMMER_PROTO_CMD_SETTINGS:
+      if (len >= 10) {
+        this->brightness_ = payload[0] | payload[1] << 8;
+        this->fade_rate_ = payload[8];
+      }
+      data = {0x01};
+      break;
+    case esphome::shelly_dimmer::SHELLY_DIMMER_PROTO_CMD_POLL: {
+      // Raw power, voltage and current readings, the bench does not interpret them.
+      const uint32_t power = 35200;
+      const uint32_t voltage = 80000;
+      const uint32_t current = 25000;
+      data = {0x02, 0x00, static_cast<uint8_t>(this->brightness_), static_cast<uint8_t>(this->brightness_ >> 8)};
+      for (uint32_t value : {power, voltage, current}) {
+        for (int shift = 0; shift < 32; shift += 8) {
+          data.push_back(static_cast<uint8_t>(value >> shift));
+        }
+      }
+      data.push_back(this->fade_rate_);
+      break;
+    }
+    case esphome::shelly_dimmer::SHELLY_DIMMER_PROTO_CMD_VERSION:
+      data = {this->minor_, this->major_};
+      break;
+    default:
+      // Unknown commands go unanswered.
+      return;
+  }
+
+  std::vector<uint8_t> frame = {PROTO_START_BYTE, seq, cmd, static_cast<uint8_t>(data.size())};
+  frame.insert(frame.end(), data.begin(), data.end());
+  const uint16_t csum = shelly_dimmer_checksum(&frame[1], 3 + data.size());
+  frame.push_back(csum >> 8);
+  frame.push_back(csum & 0xFF);
+  frame.push_back(PROTO_END_BYTE);
+  this->uart_->send(frame.data(), frame.size(), time_us + this->uart_->config().latency_us);
+}
+
+BootloaderEmulator::BootloaderEmulator(MockUart *uart, const FlashTiming &timing, bool crc_command)
+    : uart_(uart), timing_(timing), crc_command_(crc_command), flash_(FLASH_SIZE, 0xFF) {}
+
+void BootloaderEmulator::ack_(uint64_t time_us, const std::vector<uint8_t> &data) {
+  std::vector<uint8_t> reply = {BL_ACK};
+  reply.insert(reply.end(), data.begin(), data.end());
+  this->uart_->send(reply.data(), reply.size(), time_us + this->uart_->config().latency_us);
+}
+
+void BootloaderEmulator::nack_(uint64_t time_us) {
+  const uint8_t nack = BL_NACK;
+  this->nacks_++;
+  this->uart_->send(&nack, 1, time_us + this->uart_->config().latency_us);
+  this->buffer_.clear();
+  this->state_ = State::COMMAND;
+}
+
+void BootloaderEmulator::receive(uint8_t byte, uint64_t time_us) {
+  if (this->state_ == State::RUNNING) {
+    return;
+  }
+  if (this->state_ == State::WAIT_INIT) {
+    // The init byte is used for baud rate detection, anything else is line noise.
+    if (byte == BL_INIT) {
+      this->ack_(time_us);
+      this->state_ = State::COMMAND;
+    }
+    return;
+  }
+
+  this->buffer_.push_back(byte);
+  const size_t size = this->buffer_.size();
+  switch (this->state_) {
+    case State::COMMAND:
+      if (size == 2) {
+        if (this->buffer_[1] != (this->buffer_[0] ^ 0xFF)) {
+          this->nack_(time_us);
+          return;
+        }
+        const uint8_t cmd = this->buffer_[0];
+        this->buffer_.clear();
+        this->handle_command_(cmd, time_us);
+      }
+      break;
+    case State::ADDRESS:
+      if (size == 5) {
+        this->handle_address_(time_us);
+      }
+      break;
+    case State::READ_LENGTH:
+      if (size == 2) {
+        if (this->buffer_[1] != (this->buffer_[0] ^ 0xFF)) {
+          this->nack_(time_us);
+          return;
+        }
+        const uint32_t n = this->buffer_[0] + 1;
+        const uint32_t offset = this->address_ - FLASH_START;
+        if (offset + n > FLASH_SIZE) {
+          this->nack_(time_us);
+          return;
+        }
+        this->ack_(time_us, std::vector<uint8_t>(this->flash_.begin() + offset, this->flash_.begin() + offset + n));
+        this->buffer_.clear();
+        this->state_ = State::COMMAND;
+      }
+      break;
+    case State::WRITE_DATA:
+      if (size == this->buffer_[0] + 3u) {
+        this->handle_write_(time_us);
+      }
+      break;
+    case State::CRC_LENGTH:
+      if (size == 5) {
+        this->handle_crc_length_(time_us);
+      }
+      break;
+    case State::ERASE:
+      if (size >= 3 && this->buffer_[0] == 0xFF && this->buffer_[1] == 0xFF) {
+        this->handle_erase_(time_us);
+      } else if (size >= 2 && size == 2 + 2 * ((this->buffer_[0] << 8 | this->buffer_[1]) + 1u) + 1) {
+        this->handle_erase_(time_us);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void BootloaderEmulator::handle_command_(uint8_t cmd, uint64_t time_us) {
+  this->command_ = cmd;
+  switch (cmd) {
+    case BL_GET: {
+      std::vector<uint8_t> reply = {11, BL_VERSION, 0x00, 0x01, 0x02, 0x11, 0x21, 0x31, 0x44, 0x63, 0x73, 0x82, 0x92};
+      if (this->crc_command_) {
+        reply[0]++;
+        reply.push_back(BL_CRC);
+      }
+      reply.push_back(BL_ACK);
+      this->ack_(time_us, reply);
+      break;
+    }
+    case BL_GVR:
+      this->ack_(time_us, {BL_VERSION, 0x00, 0x00, BL_ACK});
+      break;
+    case BL_GID:
+      this->ack_(time_us, {1, BL_PID >> 8, BL_PID & 0xFF, BL_ACK});
+      break;
+    case BL_READ:
+    case BL_WRITE:
+    case BL_GO:
+      this->ack_(time_us);
+      this->state_ = State::ADDRESS;
+      break;
+    case BL_EXTENDED_ERASE:
+      this->ack_(time_us);
+      this->state_ = State::ERASE;
+      break;
+    case BL_CRC:
+      if (!this->crc_command_) {
+        this->nack_(time_us);
+        break;
+      }
+      this->ack_(time_us);
+      this->state_ = State::ADDRESS;
+      break;
+    default:
+      this->nack_(time_us);
+      break;
+  }
+}
+
+void BootloaderEmulator::handle_address_(uint64_t time_us) {
+  if (xor_of(this->buffer_.data(), 4) != this->buffer_[4]) {
+    this->nack_(time_us);
+    return;
+  }
+  this->address_ = this->buffer_[0] << 24 | this->buffer_[1] << 16 | this->buffer_[2] << 8 | this->buffer_[3];
+  this->buffer_.clear();
+  if (this->address_ < FLASH_START || this->address_ >= FLASH_START + FLASH_SIZE) {
+    this->nack_(time_us);
+    return;
+  }
+
+  this->ack_(time_us);
+  switch (this->command_) {
+    case BL_READ:
+      this->state_ = State::READ_LENGTH;
+      break;
+    case BL_WRITE:
+      this->state_ = State::WRITE_DATA;
+      break;
+    case BL_CRC:
+      this->state_ = State::CRC_LENGTH;
+      break;
+    default:
+      this->state_ = State::RUNNING;
+      break;
+  }
+}
+
+void BootloaderEmulator::handle_write_(uint64_t time_us) {
+  const uint32_t n = this->buffer_[0] + 1;
+  const uint32_t offset = this->address_ - FLASH_START;
+  if (xor_of(this->buffer_.data(), n + 1) != this->buffer_[n + 1] || offset + n > FLASH_SIZE) {
+    this->nack_(time_us);
+    return;
+  }
+
+  // Programming can only clear bits.
+  for (uint32_t i = 0; i < n; i++) {
+    this->flash_[offset + i] &= this->buffer_[1 + i];
+  }
+  this->ack_(time_us + (n + 1) / 2 * this->timing_.program_us_per_half_word);
+  this->buffer_.clear();
+  this->state_ = State::COMMAND;
+}
+
+void BootloaderEmulator::handle_crc_length_(uint64_t time_us) {
+  if (xor_of(this->buffer_.data(), 4) != this->buffer_[4]) {
+    this->nack_(time_us);
+    return;
+  }
+  const uint32_t length = this->buffer_[0] << 24 | this->buffer_[1] << 16 | this->buffer_[2] << 8 | this->buffer_[3];
+  const uint32_t offset = this->address_ - FLASH_START;
+  // The CRC unit works on whole words, the area has to lie within the flash.
+  if (length == 0 || length & 0x3 || (this->address_ & 0x3) || length > FLASH_SIZE - offset) {
+    this->nack_(time_us);
+    return;
+  }
+
+  this->crc_requests_++;
+  const uint32_t crc = reference_crc(this->flash_.data() + offset, length);
+  const std::vector<uint8_t> reply = {BL_ACK,
+                                      static_cast<uint8_t>(crc >> 24),
+                                      static_cast<uint8_t>(crc >> 16),
+                                      static_cast<uint8_t>(crc >> 8),
+                                      static_cast<uint8_t>(crc),
+                                      static_cast<uint8_t>((crc >> 24) ^ (crc >> 16) ^ (crc >> 8) ^ crc)};
+  // Acks the length, then the finished computation followed by the CRC.
+  this->ack_(time_us, reply);
+  this->buffer_.clear();
+  this->state_ = State::COMMAND;
+}
+
+void BootloaderEmulator::handle_erase_(uint64_t time_us) {
+  const size_t size = this->buffer_.size();
+  if (xor_of(this->buffer_.data(), size - 1) != this->buffer_[size - 1]) {
+    this->nack_(time_us);
+    return;
+  }
+
+  std::vector<uint32_t> pages;
+  if (this->buffer_[0] == 0xFF && this->buffer_[1] == 0xFF) {
+    for (uint32_t page = 0; page < FLASH_SIZE / PAGE_SIZE; page++) {
+      pages.push_back(page);
+    }
+  } else {
+    for (size_t i = 2; i + 1 < size; i += 2) {
+      pages.push_back(this->buffer_[i] << 8 | this->buffer_[i + 1]);
+    }
+  }
+  for (uint32_t page : pages) {
+    if (page >= FLASH_SIZE / PAGE_SIZE) {
+      this->nack_(time_us);
+      return;
+    }
+    std::fill_n(this->flash_.begin() + page * PAGE_SIZE, PAGE_SIZE, 0xFF);
+  }
+  this->ack_(time_us + pages.size() * this->timing_.page_erase_us);
+  this->buffer_.clear();
+  this->state_ = State::COMMAND;
+}
+
+}  // namespace bench
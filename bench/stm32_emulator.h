@@ -0,0 +1,97 @@
+#pragma once
+
+#include "mock_uart.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace bench {
+
+/// Plain bitwise CRC-32/MPEG-2 over little endian words, as the STM32 CRC unit computes it.
+/// len must be a multiple of 4.
+uint32_t reference_crc(const uint8_t *data, size_t len);
+
+/// The Shelly application firmware on the STM32: answers every valid frame, ignores corrupted ones.
+class FirmwareEmulator : public Peer {
+ public:
+  FirmwareEmulator(MockUart *uart, uint8_t major, uint8_t minor);
+
+  void receive(uint8_t byte, uint64_t time_us) override;
+
+  uint32_t frames_received() const { return this->frames_received_; }
+  uint32_t frames_dropped() const { return this->frames_dropped_; }
+
+ protected:
+  void reply_(uint64_t time_us);
+
+  MockUart *uart_;
+  uint8_t major_;
+  uint8_t minor_;
+  uint16_t brightness_{0};
+  uint8_t fade_rate_{0};
+  std::vector<uint8_t> frame_;
+  uint64_t last_byte_us_{0};
+  uint32_t frames_received_{0};
+  uint32_t frames_dropped_{0};
+};
+
+/// Timing of the STM32 flash, from the STM32F0 datasheet.
+struct FlashTiming {
+  uint32_t program_us_per_half_word{53};
+  uint32_t page_erase_us{20000};
+};
+
+/// The STM32F0 system memory bootloader (USART protocol, AN3155), reporting as an STM32F031 (0x444).
+///
+/// Supports the commands stm32flash uses for an upgrade: GET, GVR, GID, READ, GO, WRITE and EXTENDED ERASE. The
+/// STM32F0 bootloader has no CRC command, GET CHECKSUM (0xA1) of newer bootloaders can be enabled to test that path.
+class BootloaderEmulator : public Peer {
+ public:
+  static constexpr uint32_t FLASH_START = 0x08000000;
+  static constexpr uint32_t FLASH_SIZE = 32 * 1024;
+  static constexpr uint32_t PAGE_SIZE = 1024;
+
+  BootloaderEmulator(MockUart *uart, const FlashTiming &timing, bool crc_command = false);
+
+  void receive(uint8_t byte, uint64_t time_us) override;
+
+  const std::vector<uint8_t> &flash() const { return this->flash_; }
+  /// Whether GO handed over to the application.
+  bool started() const { return this->state_ == State::RUNNING; }
+  uint32_t nacks() const { return this->nacks_; }
+  uint32_t crc_requests() const { return this->crc_requests_; }
+
+ protected:
+  enum class State : uint8_t {
+    WAIT_INIT,
+    COMMAND,
+    ADDRESS,
+    READ_LENGTH,
+    WRITE_DATA,
+    ERASE,
+    CRC_LENGTH,
+    RUNNING,
+  };
+
+  void ack_(uint64_t time_us, const std::vector<uint8_t> &data = {});
+  void nack_(uint64_t time_us);
+  void handle_command_(uint8_t cmd, uint64_t time_us);
+  void handle_address_(uint64_t time_us);
+  void handle_erase_(uint64_t time_us);
+  void handle_write_(uint64_t time_us);
+  void handle_crc_length_(uint64_t time_us);
+
+  MockUart *uart_;
+  FlashTiming timing_;
+  bool crc_command_;
+  std::vector<uint8_t> flash_;
+  State state_{State::WAIT_INIT};
+  uint8_t command_{0};
+  uint32_t address_{0};
+  std::vector<uint8_t> buffer_;
+  uint32_t nacks_{0};
+  uint32_t crc_requests_{0};
+};
+
+}  // namespace bench
@@ -0,0 +1,154 @@
+#pragma once
+
+// Calibration math, kept free of ESPHome dependencies so it can be built and measured on a host.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace shelly_dimmer {
+
+/// Q0.16 representation of 1.
+constexpr float Q16_ONE = 65535.0f;
+
+/// Converts a value in the range of [0..1] to Q0.16.
+inline uint16_t to_q16(float value) {
+  return static_cast<uint16_t>(std::lround(std::clamp(value, 0.0f, 1.0f) * Q16_ONE));
+}
+
+/// Fletcher-16 checksum, which unlike a plain sum also catches reordered bytes.
+inline uint16_t fletcher16(const uint8_t *data, size_t len, uint16_t checksum = 0) {
+  uint16_t sum1 = checksum & 0xFF;
+  uint16_t sum2 = checksum >> 8;
+  for (size_t i = 0; i < len; i++) {
+    sum1 = (sum1 + data[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+  return (sum2 << 8) | sum1;
+}
+
+/// What to do with the progress of an interrupted calibration run found in flash.
+enum class CalibrationResume : uint8_t {
+  /// There is no run in progress.
+  NONE = 0,
+  /// Continue the run at its next step.
+  CONTINUE,
+  /// The run doesn't match the configuration (anymore), drop its measurements.
+  DISCARD,
+};
+
+/// Decides whether a run of run_steps steps, next_step of them measured, can continue with configured_steps steps.
+inline CalibrationResume calibration_resume_action(uint8_t run_steps, uint8_t next_step, uint8_t configured_steps) {
+  if (next_step == 0) {
+    return CalibrationResume::NONE;
+  }
+  // Steps are spread over the brightness range, measurements of a different step count belong to other brightnesses.
+  if (run_steps != configured_steps || next_step >= run_steps) {
+    return CalibrationResume::DISCARD;
+  }
+  return CalibrationResume::CONTINUE;
+}
+
+/// Makes values non-increasing by pooling adjacent violators into their mean (isotonic regression).
+/// Unlike sorting, a jittery reading only flattens the curve locally instead of shifting every later point.
+inline void pool_adjacent_violators(float *values, size_t count) {
+  for (size_t i = 1; i < count; i++) {
+    if (values[i] <= values[i - 1]) {
+      continue;
+    }
+    // Merge the violating value with the pool before it, growing the pool backwards while it is still violated.
+    size_t start = i;
+    float sum = values[i];
+    float mean;
+    do {
+      start--;
+      sum += values[start];
+      mean = sum / static_cast<float>(i - start + 1);
+    } while (start > 0 && values[start - 1] < mean);
+    std::fill(values + start, values + i + 1, mean);
+  }
+}
+
+/// Monotone cubic Hermite interpolation (Fritsch-Carlson) through up to N knots with increasing x.
+template<size_t N> class MonotoneSpline {
+ public:
+  /// Adds a knot, x must not decrease. A knot at the same x replaces the previous one.
+  void add(float x, float y) {
+    if (this->size_ != 0 && x <= this->x_[this->size_ - 1]) {
+      this->y_[this->size_ - 1] = y;
+      return;
+    }
+    if (this->size_ < N) {
+      this->x_[this->size_] = x;
+      this->y_[this->size_] = y;
+      this->size_++;
+    }
+  }
+
+  size_t size() const { return this->size_; }
+
+  /// Computes the knot tangents, call after all knots have been added.
+  void fit() {
+    if (this->size_ < 2) {
+      return;
+    }
+    std::array<float, N> secants;
+    for (size_t k = 0; k + 1 < this->size_; k++) {
+      secants[k] = (this->y_[k + 1] - this->y_[k]) / (this->x_[k + 1] - this->x_[k]);
+    }
+    this->tangents_[0] = secants[0];
+    this->tangents_[this->size_ - 1] = secants[this->size_ - 2];
+    for (size_t k = 1; k + 1 < this->size_; k++) {
+      const bool same_sign = (secants[k - 1] > 0 && secants[k] > 0) || (secants[k - 1] < 0 && secants[k] < 0);
+      this->tangents_[k] = same_sign ? (secants[k - 1] + secants[k]) / 2 : 0;
+    }
+    // Limit the tangents so no segment overshoots.
+    for (size_t k = 0; k + 1 < this->size_; k++) {
+      if (secants[k] == 0) {
+        this->tangents_[k] = 0;
+        this->tangents_[k + 1] = 0;
+        continue;
+      }
+      const float alpha = this->tangents_[k] / secants[k];
+      const float beta = this->tangents_[k + 1] / secants[k];
+      const float magnitude = alpha * alpha + beta * beta;
+      if (magnitude > 9) {
+        const float tau = 3 / std::sqrt(magnitude);
+        this->tangents_[k] = tau * alpha * secants[k];
+        this->tangents_[k + 1] = tau * beta * secants[k];
+      }
+    }
+  }
+
+  /// Evaluates the spline at x, clamping to the first and last knot.
+  float evaluate(float x) const {
+    if (x <= this->x_[0]) {
+      return this->y_[0];
+    }
+    if (x >= this->x_[this->size_ - 1]) {
+      return this->y_[this->size_ - 1];
+    }
+    size_t k = 0;
+    while (x > this->x_[k + 1]) {
+      k++;
+    }
+    const float h = this->x_[k + 1] - this->x_[k];
+    const float t = (x - this->x_[k]) / h;
+    const float t2 = t * t;
+    const float t3 = t2 * t;
+    return (2 * t3 - 3 * t2 + 1) * this->y_[k] + (t3 - 2 * t2 + t) * h * this->tangents_[k] +
+           (-2 * t3 + 3 * t2) * this->y_[k + 1] + (t3 - t2) * h * this->tangents_[k + 1];
+  }
+
+ private:
+  size_t size_{0};
+  std::array<float, N> x_;
+  std::array<float, N> y_;
+  std::array<float, N> tangents_;
+};
+
+}  // namespace shelly_dimmer
+}  // namespace esphome
@@ -23,6 +23,9 @@
 #ifdef USE_SHD_FIRMWARE_DATA
 #include "stm32flash.h"
 
+#include <array>
+#include <utility>
+
 namespace esphome {
 namespace shelly_dimmer {
 
@@ -153,6 +156,40 @@ constexpr stm32_dev_t DEVICES[] = {
     {0x0, "", 0x0, 0x0, 0x0, 0x0, 0x0, nullptr, 0x0, 0x0, 0x0, 0x0, 0x0},
 };
 
+#ifdef USE_SHD_DEVICE_IDS
+/*
+ * Only the devices whitelisted in light.py are compiled in, the table above is
+ * used at compile time only, so neither it nor the names and page sizes of the
+ * other devices end up in the image.
+ */
+constexpr uint16_t DEVICE_IDS[] = {USE_SHD_DEVICE_IDS};
+constexpr size_t DEVICE_COUNT = sizeof(DEVICE_IDS) / sizeof(DEVICE_IDS[0]);
+
+constexpr size_t device_index(uint16_t id) {
+  size_t i = 0;
+  while (DEVICES[i].id != 0x00 && DEVICES[i].id != id)
+    ++i;
+  return i;
+}
+
+constexpr bool devices_known() {
+  for (uint16_t id : DEVICE_IDS) {
+    if (DEVICES[device_index(id)].id == 0x00)
+      return false;
+  }
+  return true;
+}
+static_assert(devices_known(), "device_ids contains an unknown STM32 device id");
+
+template<size_t... I>
+constexpr std::array<stm32_dev_t, DEVICE_COUNT + 1> make_supported_devices(std::index_sequence<I...> /*unused*/) {
+  // Zero terminated, like DEVICES.
+  return {DEVICES[device_index(DEVICE_IDS[I])]..., DEVICES[device_index(0x00)]};
+}
+
+constexpr auto SUPPORTED_DEVICES = make_supported_devices(std::make_index_sequence<DEVICE_COUNT>());
+#endif
+
 }  // namespace shelly_dimmer
 }  // namespace esphome
 
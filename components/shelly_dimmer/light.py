@@ -20,17 +20,25 @@ from esphome.const import (
     UNIT_VOLT,
     UNIT_AMPERE,
     UNIT_WATT,
+    UNIT_PERCENT,
+    UNIT_MILLISECOND,
+    UNIT_WATT_HOURS,
+    DEVICE_CLASS_ENERGY,
+    STATE_CLASS_MEASUREMENT,
+    STATE_CLASS_TOTAL_INCREASING,
     DEVICE_CLASS_POWER,
     DEVICE_CLASS_VOLTAGE,
     DEVICE_CLASS_CURRENT,
+    ENTITY_CATEGORY_DIAGNOSTIC,
     CONF_MIN_BRIGHTNESS,
     CONF_MAX_BRIGHTNESS,
 )
-from esphome.core import HexInt, CORE
+from esphome.core import CORE
+from esphome.helpers import write_file_if_changed
 
 DOMAIN = "shelly_dimmer"
 AUTO_LOAD = ["sensor"]
-DEPENDENCIES = ["uart", "esp8266"]
+DEPENDENCIES = ["uart"]
 
 shelly_dimmer_ns = cg.esphome_ns.namespace("shelly_dimmer")
 ShellyDimmer = shelly_dimmer_ns.class_(
@@ -40,10 +48,100 @@ ShellyDimmer = shelly_dimmer_ns.class_(
 CONF_FIRMWARE = "firmware"
 CONF_SHA256 = "sha256"
 CONF_UPDATE = "update"
-
+CONF_DIFFERENTIAL = "differential"
+CONF_VERIFY = "verify"
+CONF_DFU_BAUD_RATE = "dfu_baud_rate"
+CONF_CRC_TABLE_SIZE = "crc_table_size"
+CONF_COMPRESS = "compress"
+CONF_DEVICE_IDS = "device_ids"
+CONF_FIRMWARE_UPGRADE_PROGRESS = "firmware_upgrade_progress"
+
+CONF_WARM_START = "warm_start"
 CONF_LEADING_EDGE = "leading_edge"
 CONF_WARMUP_BRIGHTNESS = "warmup_brightness"
 # CONF_WARMUP_TIME = "warmup_time"
+CONF_FADE_RATE = "fade_rate"
+CONF_TRANSITION_MODE = "transition_mode"
+CONF_LINK_STATISTICS = "link_statistics"
+CONF_COMPACT_LOG = "compact_log"
+CONF_PUBLISH_ON_CHANGE = "publish_on_change"
+CONF_DEADBAND = "deadband"
+CONF_SAMPLE_INTERVAL = "sample_interval"
+CONF_POWER_MIN = "power_min"
+CONF_POWER_MAX = "power_max"
+CONF_ENERGY = "energy"
+CONF_CALIBRATION = "calibration"
+CONF_STEPS = "steps"
+CONF_SAMPLES = "samples"
+CONF_INTERVAL = "interval"
+CONF_WARMUP = "warmup"
+CONF_STABILITY_THRESHOLD = "stability_threshold"
+
+TransitionMode = shelly_dimmer_ns.enum("TransitionMode")
+TRANSITION_MODES = {
+    "esp": TransitionMode.TRANSITION_MODE_ESP,
+    "firmware": TransitionMode.TRANSITION_MODE_FIRMWARE,
+}
+
+LinkStatistic = shelly_dimmer_ns.enum("LinkStatistic")
+LINK_COUNTERS = {
+    "frames_sent": LinkStatistic.LINK_STATISTIC_FRAMES_SENT,
+    "retries": LinkStatistic.LINK_STATISTIC_RETRIES,
+    "timeouts": LinkStatistic.LINK_STATISTIC_TIMEOUTS,
+    "checksum_errors": LinkStatistic.LINK_STATISTIC_CHECKSUM_ERRORS,
+    "framing_errors": LinkStatistic.LINK_STATISTIC_FRAMING_ERRORS,
+    "sequence_mismatches": LinkStatistic.LINK_STATISTIC_SEQUENCE_MISMATCHES,
+}
+LINK_LATENCIES = {
+    "ack_latency_min": LinkStatistic.LINK_STATISTIC_ACK_LATENCY_MIN,
+    "ack_latency_avg": LinkStatistic.LINK_STATISTIC_ACK_LATENCY_AVG,
+    "ack_latency_max": LinkStatistic.LINK_STATISTIC_ACK_LATENCY_MAX,
+    "ack_latency_p95": LinkStatistic.LINK_STATISTIC_ACK_LATENCY_P95,
+}
+
+LINK_STATISTICS_SCHEMA = cv.Schema(
+    {
+        **{
+            cv.Optional(key): sensor.sensor_schema(
+                icon="mdi:counter",
+                accuracy_decimals=0,
+                state_class=STATE_CLASS_TOTAL_INCREASING,
+                entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+            )
+            for key in LINK_COUNTERS
+        },
+        **{
+            cv.Optional(key): sensor.sensor_schema(
+                unit_of_measurement=UNIT_MILLISECOND,
+                icon="mdi:timer-outline",
+                accuracy_decimals=0,
+                state_class=STATE_CLASS_MEASUREMENT,
+                entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+            )
+            for key in LINK_LATENCIES
+        },
+    }
+)
+
+# Minimum change before a new measurement is published.
+DEADBAND_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_DEADBAND, default=0.0): cv.positive_float,
+    }
+)
+CALIBRATION_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_STEPS, default=20): cv.int_range(min=2, max=32),
+        cv.Optional(CONF_SAMPLES, default=3): cv.int_range(min=1, max=10),
+        cv.Optional(CONF_INTERVAL, default="1s"): cv.All(
+            cv.positive_time_period_milliseconds,
+            cv.Range(min=cv.TimePeriod(milliseconds=100)),
+        ),
+        cv.Optional(CONF_WARMUP, default="20s"): cv.positive_time_period_milliseconds,
+        # Standard deviation in W, 0 always takes all samples.
+        cv.Optional(CONF_STABILITY_THRESHOLD, default=0.0): cv.positive_float,
+    }
+)
 
 
 CONF_NRST_PIN = "nrst_pin"
@@ -110,7 +208,103 @@ def get_firmware(value):
     else:  # no caching, download every time
         firmware_data, dl_hash = dl(url)
 
-    return [HexInt(x) for x in firmware_data]
+    return firmware_data
+
+
+FIRMWARE_SOURCE = "shelly_dimmer_firmware.cpp"
+
+# LZSS parameters, must match the decoder in shelly_dimmer.cpp.
+LZSS_DISTANCE_BITS = 11
+LZSS_LENGTH_BITS = 5
+LZSS_MIN_MATCH = 3
+
+
+def compress_firmware(data):
+    """LZSS compresses the firmware image.
+
+    Every group of eight items is preceded by a flag byte, a set bit (LSB first) marks
+    a literal byte, a cleared bit a big endian 16-bit back reference holding the
+    distance - 1 in the upper LZSS_DISTANCE_BITS and the length - LZSS_MIN_MATCH in
+    the lower LZSS_LENGTH_BITS.
+    """
+    max_distance = 1 << LZSS_DISTANCE_BITS
+    max_length = (1 << LZSS_LENGTH_BITS) - 1 + LZSS_MIN_MATCH
+    out = bytearray()
+    positions = {}
+    pos = 0
+    while pos < len(data):
+        flags = len(out)
+        out.append(0)
+        for bit in range(8):
+            if pos >= len(data):
+                break
+
+            best_length, best_distance = 0, 0
+            candidates = positions.get(data[pos : pos + LZSS_MIN_MATCH], [])
+            for candidate in reversed(candidates):
+                if pos - candidate > max_distance:
+                    break
+                length = 0
+                while (
+                    length < max_length
+                    and pos + length < len(data)
+                    and data[candidate + length] == data[pos + length]
+                ):
+                    length += 1
+                if length > best_length:
+                    best_length, best_distance = length, pos - candidate
+                    if length == max_length:
+                        break
+
+            if best_length >= LZSS_MIN_MATCH:
+                word = ((best_distance - 1) << LZSS_LENGTH_BITS) | (
+                    best_length - LZSS_MIN_MATCH
+                )
+                out += bytes((word >> 8, word & 0xFF))
+                step = best_length
+            else:
+                out[flags] |= 1 << bit
+                out.append(data[pos])
+                step = 1
+
+            for i in range(pos, pos + step):
+                positions.setdefault(data[i : i + LZSS_MIN_MATCH], []).append(i)
+            pos += step
+    return bytes(out)
+
+
+def write_firmware_source(firmware_data, compress):
+    """Emits the firmware image as its own translation unit, so it is compiled once."""
+    image = compress_firmware(firmware_data) if compress else firmware_data
+    rows = []
+    for i in range(0, len(image), 16):
+        rows.append("    " + ", ".join(f"0x{x:02X}" for x in image[i : i + 16]) + ",")
+    body = "\n".join(rows)
+    content = f"""// Generated by the {DOMAIN} component, do not edit.
+#include <cstdint>
+#include <pgmspace.h>
+
+namespace esphome {{
+namespace {DOMAIN} {{
+
+// Word aligned, so the flasher can stream it with 32-bit flash reads.
+extern const uint8_t STM_FIRMWARE[] PROGMEM __attribute__((aligned(4))) = {{
+{body}
+}};
+// Size of the (uncompressed) image.
+extern const uint32_t STM_FIRMWARE_SIZE_IN_BYTES = {len(firmware_data)};
+
+}}  // namespace {DOMAIN}
+}}  // namespace esphome
+"""
+    write_file_if_changed(CORE.relative_src_path(FIRMWARE_SOURCE), content)
+
+
+def remove_firmware_source():
+    """Drops an image generated by a previous build with 'update: true'."""
+    path = Path(CORE.relative_src_path(FIRMWARE_SOURCE))
+    if path.is_file():
+        path.unlink()
 
 
 def validate_firmware(value):
@@ -138,7 +332,34 @@ def validate_version(value):
     return value
 
 
-CONFIG_SCHEMA = (
+# STM32F0 parts known to the bootloader, Shelly Dimmers use an STM32F031 (0x444).
+STM32F0_DEVICE_IDS = [0x440, 0x442, 0x444, 0x445, 0x448]
+
+
+def validate_device_ids(value):
+    # "all" keeps the complete stm32flash device table.
+    if isinstance(value, str) and value.lower() == "all":
+        return "all"
+    return cv.All(cv.ensure_list(cv.hex_uint16_t), cv.Length(min=1))(value)
+
+
+def validate_firmware_update(config):
+    # Flashing relies on the ESP8266 UART reconfiguration and PROGMEM access.
+    if config[CONF_FIRMWARE][CONF_UPDATE] and not CORE.is_esp8266:
+        raise cv.Invalid(
+            f"'{CONF_FIRMWARE}: {CONF_UPDATE}' is only supported on the ESP8266"
+        )
+    return config
+
+
+def validate_sampling(config):
+    for key in [CONF_POWER_MIN, CONF_POWER_MAX, CONF_ENERGY]:
+        if key in config and CONF_SAMPLE_INTERVAL not in config:
+            raise cv.Invalid(f"'{key}' requires '{CONF_SAMPLE_INTERVAL}' to be set")
+    return config
+
+
+CONFIG_SCHEMA = cv.All(
     light.BRIGHTNESS_ONLY_LIGHT_SCHEMA.extend(
         {
             cv.GenerateID(CONF_OUTPUT_ID): cv.declare_id(ShellyDimmer),
@@ -148,47 +369,114 @@ CONFIG_SCHEMA = (
                     cv.Optional(CONF_SHA256): validate_sha256,
                     cv.Required(CONF_VERSION): validate_version,
                     cv.Optional(CONF_UPDATE, default=False): cv.boolean,
+                    cv.Optional(CONF_DIFFERENTIAL, default=False): cv.boolean,
+                    cv.Optional(CONF_VERIFY, default=False): cv.boolean,
+                    cv.Optional(CONF_DFU_BAUD_RATE, default=115200): cv.int_range(
+                        min=1200, max=921600
+                    ),
+                    cv.Optional(CONF_CRC_TABLE_SIZE, default="1k"): cv.one_of(
+                        "1k", "4k", lower=True
+                    ),
+                    cv.Optional(CONF_COMPRESS, default=False): cv.boolean,
+                    cv.Optional(
+                        CONF_DEVICE_IDS, default=STM32F0_DEVICE_IDS
+                    ): validate_device_ids,
                 },
                 validate_firmware,  # converts a simple version key to generate the full url
                 key=CONF_VERSION,
             ),
             cv.Optional(CONF_NRST_PIN, default="GPIO5"): pins.gpio_output_pin_schema,
             cv.Optional(CONF_BOOT0_PIN, default="GPIO4"): pins.gpio_output_pin_schema,
+            cv.Optional(CONF_WARM_START, default=True): cv.boolean,
             cv.Optional(CONF_LEADING_EDGE, default=False): cv.boolean,
             cv.Optional(CONF_WARMUP_BRIGHTNESS, default=100): cv.uint16_t,
             # cv.Optional(CONF_WARMUP_TIME, default=20): cv.uint16_t,
+            cv.Optional(CONF_FADE_RATE, default=0): cv.int_range(min=0, max=100),
+            cv.Optional(CONF_TRANSITION_MODE, default="esp"): cv.enum(
+                TRANSITION_MODES, lower=True
+            ),
             cv.Optional(CONF_MIN_BRIGHTNESS, default=0): cv.uint16_t,
             cv.Optional(CONF_MAX_BRIGHTNESS, default=1000): cv.uint16_t,
             cv.Optional(CONF_POWER): sensor.sensor_schema(
                 unit_of_measurement=UNIT_WATT,
                 accuracy_decimals=1,
                 device_class=DEVICE_CLASS_POWER,
-            ),
+            ).extend(DEADBAND_SCHEMA),
             cv.Optional(CONF_VOLTAGE): sensor.sensor_schema(
                 unit_of_measurement=UNIT_VOLT,
                 accuracy_decimals=1,
                 device_class=DEVICE_CLASS_VOLTAGE,
-            ),
+            ).extend(DEADBAND_SCHEMA),
             cv.Optional(CONF_CURRENT): sensor.sensor_schema(
                 unit_of_measurement=UNIT_AMPERE,
                 device_class=DEVICE_CLASS_CURRENT,
                 accuracy_decimals=2,
+            ).extend(DEADBAND_SCHEMA),
+            cv.Optional(CONF_PUBLISH_ON_CHANGE, default=False): cv.boolean,
+            cv.Optional(CONF_SAMPLE_INTERVAL): cv.All(
+                cv.positive_time_period_milliseconds,
+                cv.Range(min=cv.TimePeriod(milliseconds=50)),
+            ),
+            cv.Optional(CONF_POWER_MIN): sensor.sensor_schema(
+                unit_of_measurement=UNIT_WATT,
+                accuracy_decimals=1,
+                device_class=DEVICE_CLASS_POWER,
+                state_class=STATE_CLASS_MEASUREMENT,
+            ),
+            cv.Optional(CONF_POWER_MAX): sensor.sensor_schema(
+                unit_of_measurement=UNIT_WATT,
+                accuracy_decimals=1,
+                device_class=DEVICE_CLASS_POWER,
+                state_class=STATE_CLASS_MEASUREMENT,
             ),
+            cv.Optional(CONF_ENERGY): sensor.sensor_schema(
+                unit_of_measurement=UNIT_WATT_HOURS,
+                accuracy_decimals=3,
+                device_class=DEVICE_CLASS_ENERGY,
+                state_class=STATE_CLASS_TOTAL_INCREASING,
+            ),
+            cv.Optional(CONF_FIRMWARE_UPGRADE_PROGRESS): sensor.sensor_schema(
+                unit_of_measurement=UNIT_PERCENT,
+                icon="mdi:progress-upload",
+                accuracy_decimals=0,
+                entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+            ),
+            cv.Optional(CONF_LINK_STATISTICS): LINK_STATISTICS_SCHEMA,
+            cv.Optional(CONF_COMPACT_LOG, default=False): cv.boolean,
+            cv.Optional(CONF_CALIBRATION, default={}): CALIBRATION_SCHEMA,
             # Change the default gamma_correct setting.
             cv.Optional(CONF_GAMMA_CORRECT, default=1.0): cv.positive_float,
         }
     )
     .extend(cv.polling_component_schema("10s"))
-    .extend(uart.UART_DEVICE_SCHEMA)
+    .extend(uart.UART_DEVICE_SCHEMA),
+    validate_sampling,
+    validate_firmware_update,
 )
 
 
 def to_code(config):
-    fw_hex = get_firmware(config[CONF_FIRMWARE])
+    fw_data = get_firmware(config[CONF_FIRMWARE])
     fw_major, fw_minor = parse_firmware_version(config[CONF_FIRMWARE][CONF_VERSION])
 
-    if fw_hex is not None:
-        cg.add_define("USE_SHD_FIRMWARE_DATA", fw_hex)
+    if fw_data is not None:
+        compress = config[CONF_FIRMWARE][CONF_COMPRESS]
+        write_firmware_source(fw_data, compress)
+        cg.add_define("USE_SHD_FIRMWARE_DATA")
+        if compress:
+            cg.add_define("USE_SHD_FIRMWARE_COMPRESSED")
+        if config[CONF_FIRMWARE][CONF_CRC_TABLE_SIZE] == "4k":
+            cg.add_define("USE_SHD_CRC_TABLE_4K")
+        device_ids = config[CONF_FIRMWARE][CONF_DEVICE_IDS]
+        if device_ids != "all":
+            cg.add_define(
+                "USE_SHD_DEVICE_IDS",
+                cg.RawExpression(", ".join(f"0x{pid:03x}" for pid in device_ids)),
+            )
+    else:
+        remove_firmware_source()
+    if config[CONF_COMPACT_LOG]:
+        cg.add_define("USE_SHD_COMPACT_LOG")
     cg.add_define("USE_SHD_FIRMWARE_MAJOR_VERSION", fw_major)
     cg.add_define("USE_SHD_FIRMWARE_MINOR_VERSION", fw_minor)
 
@@ -205,10 +493,18 @@ def to_code(config):
     cg.add(var.set_nrst_pin(nrst_pin))
     boot0_pin = yield cg.gpio_pin_expression(config[CONF_BOOT0_PIN])
     cg.add(var.set_boot0_pin(boot0_pin))
+    # Flasher settings only exist in flasher builds ('update: true').
+    if fw_data is not None:
+        cg.add(var.set_differential_flash(config[CONF_FIRMWARE][CONF_DIFFERENTIAL]))
+        cg.add(var.set_verify_flash(config[CONF_FIRMWARE][CONF_VERIFY]))
+        cg.add(var.set_dfu_baud_rate(config[CONF_FIRMWARE][CONF_DFU_BAUD_RATE]))
 
+    cg.add(var.set_warm_start(config[CONF_WARM_START]))
     cg.add(var.set_leading_edge(config[CONF_LEADING_EDGE]))
     cg.add(var.set_warmup_brightness(config[CONF_WARMUP_BRIGHTNESS]))
     # cg.add(var.set_warmup_time(config[CONF_WARMUP_TIME]))
+    cg.add(var.set_fade_rate(config[CONF_FADE_RATE]))
+    cg.add(var.set_transition_mode(config[CONF_TRANSITION_MODE]))
     cg.add(var.set_min_brightness(config[CONF_MIN_BRIGHTNESS]))
     cg.add(var.set_max_brightness(config[CONF_MAX_BRIGHTNESS]))
 
@@ -219,3 +515,32 @@ def to_code(config):
         conf = config[key]
         sens = yield sensor.new_sensor(conf)
         cg.add(getattr(var, f"set_{key}_sensor")(sens))
+        cg.add(getattr(var, f"set_{key}_deadband")(conf[CONF_DEADBAND]))
+
+    cg.add(var.set_publish_on_change(config[CONF_PUBLISH_ON_CHANGE]))
+    calibration = config[CONF_CALIBRATION]
+    cg.add(var.set_calibration_steps(calibration[CONF_STEPS]))
+    cg.add(var.set_calibration_samples(calibration[CONF_SAMPLES]))
+    cg.add(var.set_calibration_interval(calibration[CONF_INTERVAL]))
+    cg.add(var.set_calibration_warmup(calibration[CONF_WARMUP]))
+    cg.add(var.set_calibration_stability_threshold(calibration[CONF_STABILITY_THRESHOLD]))
+    if CONF_SAMPLE_INTERVAL in config:
+        cg.add(var.set_sample_interval(config[CONF_SAMPLE_INTERVAL]))
+    for key in [CONF_POWER_MIN, CONF_POWER_MAX, CONF_ENERGY]:
+        if key not in config:
+            continue
+
+        sens = yield sensor.new_sensor(config[key])
+        cg.add(getattr(var, f"set_{key}_sensor")(sens))
+
+    for key, statistic in {**LINK_COUNTERS, **LINK_LATENCIES}.items():
+        if key not in config.get(CONF_LINK_STATISTICS, {}):
+            continue
+
+        sens = yield sensor.new_sensor(config[CONF_LINK_STATISTICS][key])
+        cg.add(var.set_link_statistic_sensor(statistic, sens))
+
+    # Progress is only reported when the firmware image is built in.
+    if fw_data is not None and CONF_FIRMWARE_UPGRADE_PROGRESS in config:
+        sens = yield sensor.new_sensor(config[CONF_FIRMWARE_UPGRADE_PROGRESS])
+        cg.add(var.set_firmware_upgrade_progress_sensor(sens))
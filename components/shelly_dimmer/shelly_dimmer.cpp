@@ -1,19 +1,20 @@
 #include "esphome/core/defines.h"
 #include "esphome/core/helpers.h"
 
-#ifdef USE_ESP8266
-
 #include "shelly_dimmer.h"
+#include "calibration.h"
 #ifdef USE_SHD_FIRMWARE_DATA
 #include "stm32flash.h"
 #endif
 
-#ifndef USE_ESP_IDF
+#ifdef USE_ESP8266
 #include <HardwareSerial.h>
 #endif
 
 #include <algorithm>
+#include <cmath>
 #include <cstring>
+#include <iterator>
 #include <memory>
 #include <numeric>
 
@@ -21,116 +22,246 @@ namespace {
 
 constexpr char TAG[] = "shelly_dimmer";
 
-constexpr float CALIBRATION_STEP = 0.05f;
-constexpr uint32_t RESTORE_STATE_VERSION = 0x362A4931UL;
+constexpr uint32_t RESTORE_STATE_VERSION = 0x362A4933UL;
+constexpr uint32_t LEGACY_RESTORE_STATE_VERSION = 0x362A4931UL;
+// Layout version of the stored calibration curve.
+constexpr uint8_t CALIBRATION_FORMAT_VERSION = 2;
+// Resolution of the power measurements saved while calibrating.
+constexpr float CALIBRATION_POWER_SCALE = 10.0f;  // 0.1 W
 
-constexpr uint8_t SHELLY_DIMMER_ACK_TIMEOUT = 200;  // ms
-constexpr uint8_t SHELLY_DIMMER_MAX_RETRIES = 3;
+constexpr uint32_t SHELLY_DIMMER_BAUD_RATE = 115200;
+// A running STM32 answers VERSION within a few ms, the warm start probe must not hold up the boot.
+constexpr uint16_t SHELLY_DIMMER_WARM_PROBE_TIMEOUT = 50;  // ms
 constexpr uint16_t SHELLY_DIMMER_MAX_BRIGHTNESS = 1000;  // 100%
-
-// Protocol framing.
-constexpr uint8_t SHELLY_DIMMER_PROTO_START_BYTE = 0x01;
-constexpr uint8_t SHELLY_DIMMER_PROTO_END_BYTE = 0x04;
-
-// Supported commands.
-constexpr uint8_t SHELLY_DIMMER_PROTO_CMD_SWITCH = 0x01;
-constexpr uint8_t SHELLY_DIMMER_PROTO_CMD_POLL = 0x10;
-constexpr uint8_t SHELLY_DIMMER_PROTO_CMD_VERSION = 0x11;
-constexpr uint8_t SHELLY_DIMMER_PROTO_CMD_SETTINGS = 0x20;
+constexpr uint16_t SHELLY_DIMMER_MAX_FADE_RATE = 100;
+// The firmware moves the output by fade rate brightness steps every fade tick.
+constexpr uint32_t SHELLY_DIMMER_FADE_TICK = 10;  // ms
+// Samples further apart than this (e.g. across a link outage) are not integrated into the energy total.
+constexpr uint32_t SHELLY_DIMMER_MAX_SAMPLE_GAP = 5000;  // ms
+constexpr double MS_PER_HOUR = 3600.0 * 1000.0;
 
 // Command payload sizes.
 constexpr uint8_t SHELLY_DIMMER_PROTO_CMD_SWITCH_SIZE = 2;
 constexpr uint8_t SHELLY_DIMMER_PROTO_CMD_SETTINGS_SIZE = 10;
-constexpr uint8_t SHELLY_DIMMER_PROTO_MAX_FRAME_SIZE = 4 + 72 + 3;
-
-// STM Firmware
-#ifdef USE_SHD_FIRMWARE_DATA
-constexpr uint8_t STM_FIRMWARE[] PROGMEM = USE_SHD_FIRMWARE_DATA;
-constexpr uint32_t STM_FIRMWARE_SIZE_IN_BYTES = sizeof(STM_FIRMWARE);
-#endif
 
 // Scaling Constants
 constexpr float POWER_SCALING_FACTOR = 880373;
 constexpr float VOLTAGE_SCALING_FACTOR = 347800;
 constexpr float CURRENT_SCALING_FACTOR = 1448;
 
-// Essentially std::size() for pre c++17
-template<typename T, size_t N> constexpr size_t size(const T (&/*unused*/)[N]) noexcept { return N; }
-
 }  // Anonymous namespace
 
 namespace esphome {
 namespace shelly_dimmer {
 
-/// Computes a crappy checksum as defined by the Shelly Dimmer protocol.
-uint16_t shelly_dimmer_checksum(const uint8_t *buf, int len) {
-  return std::accumulate<decltype(buf), uint16_t>(buf, buf + len, 0);
-}
+#ifdef USE_SHD_FIRMWARE_DATA
+// STM Firmware, defined in the shelly_dimmer_firmware.cpp generated by light.py.
+extern const uint8_t STM_FIRMWARE[] PROGMEM;
+extern const uint32_t STM_FIRMWARE_SIZE_IN_BYTES;
+#endif
 
 bool ShellyDimmer::is_running_configured_version() const {
   return this->version_major_ == USE_SHD_FIRMWARE_MAJOR_VERSION &&
          this->version_minor_ == USE_SHD_FIRMWARE_MINOR_VERSION;
 }
 
+bool ShellyDimmer::probe_version_(bool warm) {
+  bool responded = false;
+  auto on_complete = [&responded](bool success) { responded = success; };
+  if (warm) {
+    this->transport_.send_probe(SHELLY_DIMMER_PROTO_CMD_VERSION, SHELLY_DIMMER_WARM_PROBE_TIMEOUT, on_complete);
+  } else {
+    this->transport_.send_command(SHELLY_DIMMER_PROTO_CMD_VERSION, nullptr, 0, on_complete);
+  }
+  this->transport_.flush();
+  return responded;
+}
+
 void ShellyDimmer::handle_firmware() {
-  // Reset the STM32 and check the firmware version.
-  this->reset_normal_boot_();
-  this->send_command_(SHELLY_DIMMER_PROTO_CMD_VERSION, nullptr, 0);
+  // Reset the STM32 and check the firmware version, unless it answered already. A wrong version is flashed anyway.
+  if (!this->version_probed_) {
+    this->reset_normal_boot_();
+    this->probe_version_(false);
+  }
   ESP_LOGI(TAG, "STM32 current firmware version: %d.%d, desired version: %d.%d", this->version_major_,
            this->version_minor_, USE_SHD_FIRMWARE_MAJOR_VERSION, USE_SHD_FIRMWARE_MINOR_VERSION);
 
   if (!is_running_configured_version()) {
 #ifdef USE_SHD_FIRMWARE_DATA
-    if (!this->upgrade_firmware_()) {
-      ESP_LOGW(TAG, "Failed to upgrade firmware");
-      this->mark_failed();
-      return;
-    }
-
-    this->reset_normal_boot_();
-    this->send_command_(SHELLY_DIMMER_PROTO_CMD_VERSION, nullptr, 0);
-    if (!is_running_configured_version()) {
-      ESP_LOGE(TAG, "STM32 firmware upgrade already performed, but version is still incorrect");
-      this->mark_failed();
-      return;
-    }
+    // The upgrade runs from loop(), setup completes once the new firmware reports the expected version.
+    this->start_firmware_upgrade_();
 #else
+    // Runtime build, the flasher code is not linked in.
     ESP_LOGW(TAG, "Firmware version mismatch, put 'update: true' in the yaml to flash an update.");
+    this->status_set_warning();
 #endif
   }
 }
 
 void ShellyDimmer::setup() {
+  // Latch the run levels before the pins become outputs, so a running STM32 isn't reset by accident.
+  this->pin_boot0_->digital_write(false);
+  this->pin_nrst_->digital_write(true);
   this->pin_nrst_->setup();
   this->pin_boot0_->setup();
+  this->pin_boot0_->digital_write(false);
+  this->pin_nrst_->digital_write(true);
 
   ESP_LOGI(TAG, "Initializing Shelly Dimmer...");
 
-  this->handle_firmware();
+  this->calibration_data_.fill(0);
+  this->calibration_curve_.fill(0);
+  // Lives in flash, calibration data is written rarely and should survive a power cycle.
+  this->rtc_ = global_preferences->make_preference<CalibrationData>(
+      this->state_->get_object_id_hash() ^ RESTORE_STATE_VERSION, true);
+  this->load_calibration_();
+  this->rebuild_brightness_table_();
+
+  // Early phase: the STM32 keeps running across ESP reboots and OTA updates, and boots along with the ESP after a
+  // power cut. If it answers with the right firmware, the restored brightness goes out right away.
+  if (this->warm_start_) {
+    while (this->available()) {
+      this->read();
+    }
+    this->version_probed_ = this->probe_version_(true);
+    ESP_LOGD(TAG, "Warm start probe %s", this->version_probed_ ? "answered" : "timed out");
+    if (this->version_probed_ && this->is_running_configured_version()) {
+      ESP_LOGI(TAG, "STM32 running firmware version %d.%d", this->version_major_, this->version_minor_);
+      this->complete_setup_();
+      return;
+    }
+  }
+
+  // Resetting, checking and flashing the firmware are left to loop(), once everything else has been set up.
+  this->firmware_check_pending_ = true;
+}
 
+void ShellyDimmer::complete_setup_() {
+  this->transport_.begin_batch();
   this->send_settings_();
   // Do an immediate poll to refresh current state.
-  this->send_command_(SHELLY_DIMMER_PROTO_CMD_POLL, nullptr, 0);
+  this->transport_.send_command(SHELLY_DIMMER_PROTO_CMD_POLL, nullptr, 0);
+  this->transport_.end_batch();
 
-  this->calibration_data_.fill(0);
-  this->rtc_ = global_preferences->make_preference<std::array<float, 20>>(this->state_->get_object_id_hash() ^
-                                                                          RESTORE_STATE_VERSION);
-  if (this->rtc_.load(&this->calibration_data_)) {
-    ESP_LOGD(TAG, "Loaded calibration from flash");
-    for (float value : this->calibration_data_) {
-      ESP_LOGV(TAG, "%f", value);
+  this->ready_ = true;
+  // Spread the fast sampling polls of the dimmers sharing this node across the interval.
+  this->last_sample_time_ =
+      millis() - this->sample_interval_ + this->transport_.schedule_offset(this->sample_interval_);
+
+  // Pick up a calibration run interrupted by a reboot.
+  this->resume_calibration_();
+}
+
+void ShellyDimmer::loop() {
+  if (this->firmware_check_pending_) {
+    // Late phase of setup().
+    this->firmware_check_pending_ = false;
+    this->handle_firmware();
+#ifdef USE_SHD_FIRMWARE_DATA
+    if (this->upgrade_state_ != FirmwareUpgradeState::IDLE) {
+      return;
     }
+#endif
+    this->complete_setup_();
+    return;
   }
 
-  this->ready_ = true;
+#ifdef USE_SHD_FIRMWARE_DATA
+  // The UART belongs to the STM32 bootloader while an upgrade is running.
+  if (this->upgrade_state_ != FirmwareUpgradeState::IDLE) {
+    this->process_firmware_upgrade_();
+    return;
+  }
+#endif
+
+  this->transport_.loop();
+  if (this->ready_ && this->sample_interval_ != 0) {
+    this->sample_();
+  }
 }
 
 void ShellyDimmer::update() {
-  this->send_command_(SHELLY_DIMMER_PROTO_CMD_POLL, nullptr, 0);
+  if (!this->ready_) {
+    return;
+  }
 
-  if (this->calibrating_) {
-    this->perform_calibration_measurement_();
+  // In fast sampling mode measurements come in from loop(), calibration publishes every reading.
+  if (this->sample_interval_ == 0) {
+    this->transport_.send_command(SHELLY_DIMMER_PROTO_CMD_POLL, nullptr, 0);
+  } else if (!this->calibrating_) {
+    this->publish_samples_();
   }
+
+  this->publish_link_statistics_();
+}
+
+void ShellyDimmer::sample_() {
+  const uint32_t now = millis();
+  // At most one sampling POLL at a time, so an unresponsive STM32 does not fill up the queue.
+  if (this->sample_pending_ || now - this->last_sample_time_ < this->sample_interval_) {
+    return;
+  }
+
+  this->last_sample_time_ = now;
+  this->sample_pending_ = this->transport_.send_command(SHELLY_DIMMER_PROTO_CMD_POLL, nullptr, 0,
+                                              [this](bool /*success*/) { this->sample_pending_ = false; });
+}
+
+void ShellyDimmer::accumulate_sample_(float power, float voltage, float current) {
+  SampleAggregate &samples = this->samples_;
+  const uint32_t now = millis();
+
+  // Trapezoidal integration between consecutive samples.
+  if (samples.have_last && now - samples.last_time <= SHELLY_DIMMER_MAX_SAMPLE_GAP) {
+    this->energy_ += (samples.last_power + power) / 2.0 * (now - samples.last_time) / MS_PER_HOUR;
+  }
+  samples.have_last = true;
+  samples.last_power = power;
+  samples.last_time = now;
+
+  samples.power_min = samples.count == 0 ? power : std::min(samples.power_min, power);
+  samples.power_max = samples.count == 0 ? power : std::max(samples.power_max, power);
+  samples.power_sum += power;
+  samples.voltage_sum += voltage;
+  samples.current_sum += current;
+  samples.count++;
+}
+
+void ShellyDimmer::publish_samples_() {
+  SampleAggregate &samples = this->samples_;
+  if (samples.count == 0) {
+    ESP_LOGW(TAG, "No samples received during the last update interval");
+    return;
+  }
+
+  const float power = samples.power_sum / samples.count;
+  ESP_LOGD(TAG, "Sampled %u times: power %.1f W (min %.1f W, max %.1f W), energy %.3f Wh", samples.count, power,
+           samples.power_min, samples.power_max, this->energy_);
+
+  if (this->power_sensor_ != nullptr) {
+    this->power_sensor_->publish_state(power);
+  }
+  if (this->voltage_sensor_ != nullptr) {
+    this->voltage_sensor_->publish_state(samples.voltage_sum / samples.count);
+  }
+  if (this->current_sensor_ != nullptr) {
+    this->current_sensor_->publish_state(samples.current_sum / samples.count);
+  }
+  if (this->power_min_sensor_ != nullptr) {
+    this->power_min_sensor_->publish_state(samples.power_min);
+  }
+  if (this->power_max_sensor_ != nullptr) {
+    this->power_max_sensor_->publish_state(samples.power_max);
+  }
+  if (this->energy_sensor_ != nullptr) {
+    this->energy_sensor_->publish_state(this->energy_);
+  }
+
+  // Start a new interval, the energy total and the integration state carry over.
+  samples.count = 0;
+  samples.power_sum = 0;
+  samples.voltage_sum = 0;
+  samples.current_sum = 0;
 }
 
 void ShellyDimmer::dump_config() {
@@ -141,16 +272,28 @@ void ShellyDimmer::dump_config() {
   ESP_LOGCONFIG(TAG, "  Leading Edge: %s", YESNO(this->leading_edge_));
   ESP_LOGCONFIG(TAG, "  Warmup Brightness: %d", this->warmup_brightness_);
   // ESP_LOGCONFIG(TAG, "  Warmup Time: %d", this->warmup_time_);
-  // ESP_LOGCONFIG(TAG, "  Fade Rate: %d", this->fade_rate_);
+  ESP_LOGCONFIG(TAG, "  Fade Rate: %d", this->fade_rate_);
+  ESP_LOGCONFIG(TAG, "  Transition Mode: %s", this->transition_mode_ == TRANSITION_MODE_FIRMWARE ? "firmware" : "esp");
   ESP_LOGCONFIG(TAG, "  Minimum Brightness: %d", this->min_brightness_);
   ESP_LOGCONFIG(TAG, "  Maximum Brightness: %d", this->max_brightness_);
 
   LOG_UPDATE_INTERVAL(this);
+#ifdef USE_SHD_FIRMWARE_DATA
+  LOG_SENSOR("  ", "Firmware Upgrade Progress", this->firmware_upgrade_progress_sensor_);
+#endif
 
+#ifdef USE_SHD_FIRMWARE_DATA
+  ESP_LOGCONFIG(TAG, "  Firmware Mode: flasher");
+#else
+  ESP_LOGCONFIG(TAG, "  Firmware Mode: runtime");
+#endif
   ESP_LOGCONFIG(TAG, "  STM32 current firmware version: %d.%d ", this->version_major_, this->version_minor_);
+  ESP_LOGCONFIG(TAG, "  Warm Start: %s", YESNO(this->warm_start_));
   ESP_LOGCONFIG(TAG, "  STM32 required firmware version: %d.%d", USE_SHD_FIRMWARE_MAJOR_VERSION,
                 USE_SHD_FIRMWARE_MINOR_VERSION);
-  ESP_LOGCONFIG(TAG, "  Calibrated: %s", YESNO(this->calibration_data_[0] != 0));
+  ESP_LOGCONFIG(TAG, "  Calibrated: %s", YESNO(this->calibration_size_ != 0));
+  ESP_LOGCONFIG(TAG, "  Calibration: %d steps, %d samples, %u ms interval, %u ms warmup", this->calibration_steps_,
+                this->calibration_samples_, this->calibration_interval_, this->calibration_warmup_);
 
   if (this->version_major_ != USE_SHD_FIRMWARE_MAJOR_VERSION ||
       this->version_minor_ != USE_SHD_FIRMWARE_MINOR_VERSION) {
@@ -167,92 +310,444 @@ void ShellyDimmer::write_state(light::LightState *state) {
   state->current_values_as_brightness(&brightness);
 
   // If we are in a process of calibration, don't mess with brightness.
-  // Also check whether we have calibration data and wheteher edge values were requested.
-  if (!this->calibrating_ && this->calibration_data_[0] != 0.0f && brightness != 0 && brightness != 1.0f) {
-    // We have calibration data, find the nearest range and remap value
-    uint32_t pos;
-    for (pos = 0; pos < this->calibration_data_.size(); ++pos) {
-      if (this->calibration_data_[pos] < brightness) {
-        break;
-      }
+  const uint16_t brightness_int =
+      this->calibrating_ ? this->convert_brightness_(brightness) : this->lookup_brightness_(brightness);
+  const optional<uint16_t> current =
+      this->pending_brightness_.has_value() ? this->pending_brightness_ : this->brightness_;
+  if (current.has_value() && *current == brightness_int) {
+    ESP_LOGV(TAG, "Not sending unchanged value");
+    return;
+  }
+  ESP_LOGD(TAG, "Brightness update: %d (raw: %f)", brightness_int, brightness);
+
+  // Settings go out first so that the new fade rate applies to this brightness change, both in one burst.
+  const uint16_t fade_rate = this->transition_fade_rate_.value_or(this->fade_rate_);
+  this->transport_.begin_batch();
+  if (fade_rate != this->sent_fade_rate_) {
+    this->send_settings_frame_(this->brightness_.value_or(brightness_int), fade_rate);
+  }
+
+  this->send_brightness_(brightness_int);
+  this->transport_.end_batch();
+}
+
+std::unique_ptr<light::LightTransformer> ShellyDimmer::create_default_transition() {
+  if (this->transition_mode_ != TRANSITION_MODE_FIRMWARE) {
+    return light::LightOutput::create_default_transition();
+  }
+  return std::make_unique<ShellyDimmerTransformer>(this);
+}
+
+void ShellyDimmer::begin_firmware_transition_(float start, float target, uint32_t length) {
+  // LightState already jumped to the target of an interrupted transition, the output is still on its way there.
+  const uint16_t from = this->fade_position_now_().value_or(this->lookup_brightness_(start));
+  const uint16_t to = this->lookup_brightness_(target);
+  const uint32_t delta = from > to ? from - to : to - from;
+  const uint32_t ticks = std::max(length / SHELLY_DIMMER_FADE_TICK, uint32_t{1});
+
+  // Round up so that the fade finishes within the requested transition length.
+  const uint32_t fade_rate = (delta + ticks - 1) / ticks;
+  this->transition_fade_rate_ = std::clamp<uint32_t>(fade_rate, 1, SHELLY_DIMMER_MAX_FADE_RATE);
+
+  ESP_LOGD(TAG, "Firmware transition %d -> %d over %u ms, fade rate %d", from, to, length,
+           *this->transition_fade_rate_);
+}
+
+void ShellyDimmer::end_firmware_transition_() { this->transition_fade_rate_.reset(); }
+
+optional<light::LightColorValues> ShellyDimmerTransformer::apply() {
+  if (this->applied_) {
+    // The firmware is fading, nothing left to write until the transition ends.
+    return {};
+  }
+  this->applied_ = true;
+
+  float start, target;
+  const float gamma = this->parent_->state_->get_gamma_correct();
+  this->start_values_.as_brightness(&start, gamma);
+  this->target_values_.as_brightness(&target, gamma);
+  this->parent_->begin_firmware_transition_(start, target, this->length_);
+
+  return this->target_values_;
+}
+#ifdef USE_SHD_FIRMWARE_DATA
+namespace {
+
+constexpr uint32_t CRC_CHUNK_SIZE = 256;
+constexpr uint32_t CRC_INIT_VALUE = 0xFFFFFFFF;
+constexpr uint8_t VERIFY_RETRIES = 3;
+
+#ifdef USE_SHD_FIRMWARE_COMPRESSED
+// LZSS parameters, must match compress_firmware() in light.py.
+constexpr uint8_t LZSS_LENGTH_BITS = 5;
+constexpr uint8_t LZSS_MIN_MATCH = 3;
+// Covers the maximum back reference distance and keeps a whole (up to 2k) flash page around for rereads.
+constexpr uint32_t LZSS_WINDOW_SIZE = 2048;
+
+/// Streaming decoder for the LZSS compressed firmware image.
+///
+/// Decoded bytes are kept in a ring window, so reads may go back by up to LZSS_WINDOW_SIZE bytes, e.g. to
+/// rewrite the page just compared. Seeking back further restarts decoding from the beginning of the image.
+class FirmwareDecoder {
+ public:
+  /// Returns the image byte at the given offset, which must be within the image.
+  uint8_t at(uint32_t offset) {
+    if (!this->window_ || (offset < this->out_pos_ && this->out_pos_ - offset > LZSS_WINDOW_SIZE)) {
+      this->restart_();
     }
-    if (pos == this->calibration_data_.size() || pos == 0) {
-      ESP_LOGW(TAG, "Failed to find suitable calibration range for brightness %f", brightness);
-    } else {
-      float min = this->calibration_data_[pos];
-      float max = this->calibration_data_[pos - 1];
-      float min_out = 1 - (float) pos * CALIBRATION_STEP;
-      float max_out = min_out + CALIBRATION_STEP;
-      float remapped = remap(brightness, min, max, min_out, max_out);
+    while (this->out_pos_ <= offset) {
+      this->decode_();
+    }
+    return this->window_[offset % LZSS_WINDOW_SIZE];
+  }
 
-      ESP_LOGD(TAG, "Remapped %f to %f (min %f, max %f, min_out %f, max_out %f)", brightness, remapped, min, max,
-               min_out, max_out);
+  /// Frees the window once the upgrade is over.
+  void release() { this->window_.reset(); }
 
-      brightness = remapped;
+ protected:
+  void restart_() {
+    if (!this->window_) {
+      this->window_ = std::unique_ptr<uint8_t[]>(new uint8_t[LZSS_WINDOW_SIZE]);
     }
+    this->in_pos_ = 0;
+    this->out_pos_ = 0;
+    this->flags_ = 0;
+    this->flag_bits_ = 0;
+    this->match_length_ = 0;
   }
 
-  const uint16_t brightness_int = this->convert_brightness_(brightness);
-  if (brightness_int == this->brightness_) {
-    ESP_LOGV(TAG, "Not sending unchanged value");
-    return;
+  uint8_t next_input_() { return pgm_read_byte(STM_FIRMWARE + this->in_pos_++); }
+
+  /// Decodes a single byte into the window.
+  void decode_() {
+    if (this->match_length_ == 0) {
+      if (this->flag_bits_ == 0) {
+        this->flags_ = this->next_input_();
+        this->flag_bits_ = 8;
+      }
+      const bool literal = this->flags_ & 1;
+      this->flags_ >>= 1;
+      this->flag_bits_--;
+
+      if (literal) {
+        this->window_[this->out_pos_++ % LZSS_WINDOW_SIZE] = this->next_input_();
+        return;
+      }
+      const uint16_t high = this->next_input_();
+      const uint16_t reference = (high << 8) | this->next_input_();
+      this->match_distance_ = (reference >> LZSS_LENGTH_BITS) + 1;
+      this->match_length_ = (reference & ((1 << LZSS_LENGTH_BITS) - 1)) + LZSS_MIN_MATCH;
+    }
+
+    const uint8_t c = this->window_[(this->out_pos_ - this->match_distance_) % LZSS_WINDOW_SIZE];
+    this->window_[this->out_pos_++ % LZSS_WINDOW_SIZE] = c;
+    this->match_length_--;
   }
-  ESP_LOGD(TAG, "Brightness update: %d (raw: %f)", brightness_int, brightness);
 
-  this->send_brightness_(brightness_int);
+  std::unique_ptr<uint8_t[]> window_;
+  // Position in the compressed stream and number of bytes decoded so far.
+  uint32_t in_pos_{0};
+  uint32_t out_pos_{0};
+  uint8_t flags_{0};
+  uint8_t flag_bits_{0};
+  uint16_t match_distance_{0};
+  uint8_t match_length_{0};
+};
+
+FirmwareDecoder decoder;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+#endif
+
+/// Copies part of the firmware image, the area past the end of the image reads as erased flash (0xFF).
+void read_firmware(uint32_t offset, uint8_t *buf, uint32_t len) {
+  const uint32_t available = offset < STM_FIRMWARE_SIZE_IN_BYTES ? STM_FIRMWARE_SIZE_IN_BYTES - offset : 0;
+  const uint32_t copy = std::min(len, available);
+#ifdef USE_SHD_FIRMWARE_COMPRESSED
+  // Decompressed straight into the caller's (chunk sized) buffer, the image is never inflated as a whole.
+  for (uint32_t i = 0; i < copy; i++) {
+    buf[i] = decoder.at(offset + i);
+  }
+#else
+  memcpy_P(buf, STM_FIRMWARE + offset, copy);
+#endif
+  std::memset(buf + copy, 0xFF, len - copy);
 }
-#ifdef USE_SHD_FIRMWARE_DATA
-bool ShellyDimmer::upgrade_firmware_() {
-  ESP_LOGW(TAG, "Starting STM32 firmware upgrade");
-  this->reset_dfu_boot_();
 
-  // Cleanup with RAII
-  auto stm32 = stm32_init(this, STREAM_SERIAL, 1);
+/// Releases resources used for reading the firmware image.
+void release_firmware() {
+#ifdef USE_SHD_FIRMWARE_COMPRESSED
+  decoder.release();
+#endif
+}
 
-  if (!stm32) {
-    ESP_LOGW(TAG, "Failed to initialize STM32");
-    return false;
+/// Returns the size of the given flash page, see the page size arrays in dev_table.h.
+uint32_t flash_page_size(const stm32_unique_ptr &stm, uint32_t page) {
+  const uint32_t *psize = stm->dev->fl_ps;
+  while (page-- && psize[1]) {
+    psize++;
   }
+  return psize[0];
+}
 
-  // Erase STM32 flash.
-  if (stm32_erase_memory(stm32, 0, STM32_MASS_ERASE) != STM32_ERR_OK) {
-    ESP_LOGW(TAG, "Failed to erase STM32 flash memory");
-    return false;
+/// Computes the CRC the STM32 would report for a flash range holding the given part of the firmware image.
+uint32_t firmware_crc(uint32_t offset, uint32_t len) {
+  uint8_t buffer[CRC_CHUNK_SIZE];
+  uint32_t crc = CRC_INIT_VALUE;
+  while (len) {
+    const uint32_t n = std::min(len, CRC_CHUNK_SIZE);
+    read_firmware(offset, buffer, n);
+    crc = stm32_sw_crc(crc, buffer, n);
+    offset += n;
+    len -= n;
   }
+  return crc;
+}
 
-  static constexpr uint32_t BUFFER_SIZE = 256;
+/// Starts writing the given part of the firmware image to flash, skipping the area past the end of the image.
+stm32_err_t start_firmware_write(const stm32_unique_ptr &stm, stm32_write_t &write, uint32_t offset, uint32_t len) {
+  const uint32_t end = std::min(offset + len, STM_FIRMWARE_SIZE_IN_BYTES);
+  if (offset >= end) {
+    return STM32_ERR_OK;
+  }
 
-  // Copy the STM32 firmware over in 256-byte chunks. Note that the firmware is stored
-  // in flash memory so all accesses need to be 4-byte aligned.
-  uint8_t buffer[BUFFER_SIZE];
-  const uint8_t *p = STM_FIRMWARE;
-  uint32_t offset = 0;
-  uint32_t addr = stm32->dev->fl_start;
-  const uint32_t end = addr + STM_FIRMWARE_SIZE_IN_BYTES;
+#ifdef USE_SHD_FIRMWARE_COMPRESSED
+  // The next chunk is decompressed while the previous one is being acknowledged.
+  const auto source = [offset](uint32_t pos, uint8_t *buf, unsigned int n) {
+    read_firmware(offset + pos, buf, n);
+    return true;
+  };
+  return stm32_write_start(stm, write, stm->dev->fl_start + offset, source, end - offset);
+#else
+  // Streamed straight out of PROGMEM.
+  return stm32_write_start_progmem(stm, write, stm->dev->fl_start + offset, STM_FIRMWARE + offset, end - offset);
+#endif
+}
+
+/// Checks whether the flash page at the given image offset holds the corresponding part of the firmware image.
+stm32_err_t compare_page(const stm32_unique_ptr &stm, uint32_t offset, uint32_t psize, bool *match) {
+  if (stm->dev->fl_start + offset + psize > stm->dev->fl_end) {
+    ESP_LOGW(TAG, "Firmware does not fit into STM32 flash");
+    return STM32_ERR_UNKNOWN;
+  }
+
+  uint32_t crc;
+  const stm32_err_t err = stm32_crc_wrapper(stm, stm->dev->fl_start + offset, psize, &crc);
+  if (err != STM32_ERR_OK) {
+    return err;
+  }
+
+  *match = crc == firmware_crc(offset, psize);
+  return STM32_ERR_OK;
+}
 
-  while (addr < end && offset < STM_FIRMWARE_SIZE_IN_BYTES) {
-    const uint32_t left_of_buffer = std::min(end - addr, BUFFER_SIZE);
-    const uint32_t len = std::min(left_of_buffer, STM_FIRMWARE_SIZE_IN_BYTES - offset);
+}  // namespace
+
+void ShellyDimmer::start_firmware_upgrade_() {
+  ESP_LOGW(TAG, "Starting STM32 firmware upgrade");
+  this->ready_ = false;
+  this->upgrade_progress_ = -1;
+  this->upgrade_state_ = FirmwareUpgradeState::INIT;
+  // The writes only advance from loop(), don't let it idle between acks.
+  this->high_freq_.start();
+}
 
-    if (len == 0) {
+void ShellyDimmer::process_firmware_upgrade_() {
+  switch (this->upgrade_state_) {
+    case FirmwareUpgradeState::INIT: {
+      this->reset_dfu_boot_(this->dfu_baud_rate_);
+      this->stm32_ = stm32_init(this, STREAM_SERIAL, 1);
+
+      // The bootloader detects the baud rate from the init byte, but not every part syncs at higher rates.
+      if (!this->stm32_ && this->dfu_baud_rate_ != SHELLY_DIMMER_BAUD_RATE) {
+        ESP_LOGW(TAG, "Failed to initialize STM32 at %u baud, retrying at %u baud", this->dfu_baud_rate_,
+                 SHELLY_DIMMER_BAUD_RATE);
+        this->reset_dfu_boot_(SHELLY_DIMMER_BAUD_RATE);
+        this->stm32_ = stm32_init(this, STREAM_SERIAL, 1);
+      }
+
+      if (!this->stm32_) {
+        ESP_LOGW(TAG, "Failed to initialize STM32");
+        this->fail_firmware_upgrade_();
+        return;
+      }
+
+      this->upgrade_offset_ = 0;
+      this->upgrade_page_ = 0;
+      this->upgrade_attempts_ = 0;
+      this->upgrade_verifying_ = false;
+      this->upgrade_full_write_ = false;
+      this->upgrade_state_ =
+          this->differential_flash_ ? FirmwareUpgradeState::COMPARE : FirmwareUpgradeState::ERASE;
       break;
     }
+    case FirmwareUpgradeState::ERASE: {
+      // Erase STM32 flash, the whole image is written afterwards.
+      if (stm32_erase_memory(this->stm32_, 0, STM32_MASS_ERASE) != STM32_ERR_OK) {
+        ESP_LOGW(TAG, "Failed to erase STM32 flash memory");
+        this->fail_firmware_upgrade_();
+        return;
+      }
+      this->upgrade_full_write_ = true;
+      this->upgrade_write_pos_ = 0;
+      this->upgrade_write_end_ = STM_FIRMWARE_SIZE_IN_BYTES;
+      this->upgrade_state_ = FirmwareUpgradeState::WRITE;
+      break;
+    }
+    case FirmwareUpgradeState::COMPARE: {
+      this->compare_firmware_page_();
+      break;
+    }
+    case FirmwareUpgradeState::WRITE: {
+      // Copy the STM32 firmware over without waiting for its acks, each loop iteration picks up what has arrived.
+      const uint32_t acked = this->upgrade_write_ ? this->upgrade_write_->offset : 0;
+      stm32_err_t err;
+      if (!this->upgrade_write_) {
+        this->upgrade_write_ = std::make_unique<stm32_write_t>();
+        err = start_firmware_write(this->stm32_, *this->upgrade_write_, this->upgrade_write_pos_,
+                                   this->upgrade_write_end_ - this->upgrade_write_pos_);
+      } else {
+        err = stm32_write_poll(this->stm32_, *this->upgrade_write_);
+      }
+      if (err == STM32_ERR_PENDING) {
+        this->upgrade_write_pos_ += this->upgrade_write_->offset - acked;
+        break;
+      }
+      this->upgrade_write_.reset();
+      if (err != STM32_ERR_OK) {
+        ESP_LOGW(TAG, "Failed to write to STM32 flash memory");
+        this->fail_firmware_upgrade_();
+        return;
+      }
+      this->upgrade_write_pos_ = this->upgrade_write_end_;
+
+      if (this->upgrade_full_write_) {
+        this->finish_firmware_upgrade_phase_();
+      } else if (this->upgrade_verifying_) {
+        // Check the rewritten page once more.
+        this->upgrade_state_ = FirmwareUpgradeState::COMPARE;
+      } else {
+        this->upgrade_offset_ = this->upgrade_write_end_;
+        this->upgrade_page_++;
+        this->upgrade_state_ = FirmwareUpgradeState::COMPARE;
+      }
+      break;
+    }
+    case FirmwareUpgradeState::REBOOT: {
+      ESP_LOGI(TAG, "STM32 firmware upgrade successful, 'update: false' builds can be used from now on");
+      this->stm32_.reset();
+      release_firmware();
+      this->upgrade_state_ = FirmwareUpgradeState::IDLE;
+      this->high_freq_.stop();
+
+      this->reset_normal_boot_();
+      this->transport_.send_command(SHELLY_DIMMER_PROTO_CMD_VERSION, nullptr, 0, [this](bool success) {
+        if (!success || !this->is_running_configured_version()) {
+          ESP_LOGE(TAG, "STM32 firmware upgrade already performed, but version is still incorrect");
+          this->mark_failed();
+          return;
+        }
+        this->complete_setup_();
+      });
+      return;
+    }
+    case FirmwareUpgradeState::IDLE:
+      return;
+  }
 
-    std::memcpy(buffer, p, BUFFER_SIZE);
-    p += BUFFER_SIZE;
+  this->publish_firmware_upgrade_progress_();
+}
 
-    if (stm32_write_memory(stm32, addr, buffer, len) != STM32_ERR_OK) {
-      ESP_LOGW(TAG, "Failed to write to STM32 flash memory");
-      return false;
+void ShellyDimmer::compare_firmware_page_() {
+  if (this->upgrade_offset_ >= STM_FIRMWARE_SIZE_IN_BYTES) {
+    this->finish_firmware_upgrade_phase_();
+    return;
+  }
+
+  const uint32_t psize = flash_page_size(this->stm32_, this->upgrade_page_);
+  bool match;
+  if (compare_page(this->stm32_, this->upgrade_offset_, psize, &match) != STM32_ERR_OK) {
+    if (this->upgrade_verifying_) {
+      ESP_LOGW(TAG, "Failed to verify STM32 firmware");
+      this->fail_firmware_upgrade_();
+    } else {
+      ESP_LOGW(TAG, "Differential flashing failed, rewriting the whole image");
+      this->upgrade_state_ = FirmwareUpgradeState::ERASE;
     }
+    return;
+  }
 
-    addr += len;
-    offset += len;
+  if (match) {
+    this->upgrade_offset_ += psize;
+    this->upgrade_page_++;
+    this->upgrade_attempts_ = 0;
+    return;
   }
 
-  ESP_LOGI(TAG, "STM32 firmware upgrade successful");
+  if (this->upgrade_verifying_) {
+    if (this->upgrade_attempts_ == VERIFY_RETRIES) {
+      ESP_LOGW(TAG, "STM32 flash page %u still differs after %u rewrites", this->upgrade_page_, VERIFY_RETRIES);
+      this->fail_firmware_upgrade_();
+      return;
+    }
+    this->upgrade_attempts_++;
+    ESP_LOGW(TAG, "STM32 flash page %u failed verification, rewriting", this->upgrade_page_);
+  } else {
+    ESP_LOGD(TAG, "STM32 flash page %u differs, rewriting", this->upgrade_page_);
+  }
 
-  return true;
+  if (stm32_erase_memory(this->stm32_, this->upgrade_page_, 1) != STM32_ERR_OK) {
+    ESP_LOGW(TAG, "Failed to erase STM32 flash page %u", this->upgrade_page_);
+    this->fail_firmware_upgrade_();
+    return;
+  }
+  this->upgrade_write_pos_ = this->upgrade_offset_;
+  this->upgrade_write_end_ = this->upgrade_offset_ + psize;
+  this->upgrade_state_ = FirmwareUpgradeState::WRITE;
+}
+
+void ShellyDimmer::finish_firmware_upgrade_phase_() {
+  if (this->verify_flash_ && !this->upgrade_verifying_) {
+    ESP_LOGI(TAG, "Verifying STM32 firmware");
+    this->upgrade_verifying_ = true;
+    this->upgrade_full_write_ = false;
+    this->upgrade_offset_ = 0;
+    this->upgrade_page_ = 0;
+    this->upgrade_attempts_ = 0;
+    this->upgrade_state_ = FirmwareUpgradeState::COMPARE;
+    return;
+  }
+  this->upgrade_state_ = FirmwareUpgradeState::REBOOT;
+}
+
+void ShellyDimmer::fail_firmware_upgrade_() {
+  ESP_LOGW(TAG, "Failed to upgrade firmware");
+  this->upgrade_write_.reset();
+  this->stm32_.reset();
+  release_firmware();
+  this->upgrade_state_ = FirmwareUpgradeState::IDLE;
+  this->high_freq_.stop();
+  this->mark_failed();
+}
+
+void ShellyDimmer::publish_firmware_upgrade_progress_() {
+  // Writing (or comparing) and verifying each walk over the image once.
+  const uint32_t passes = this->verify_flash_ ? 2 : 1;
+  uint32_t done = this->upgrade_full_write_ ? this->upgrade_write_pos_ : this->upgrade_offset_;
+  if (this->upgrade_verifying_) {
+    done += STM_FIRMWARE_SIZE_IN_BYTES;
+  }
+  if (this->upgrade_state_ == FirmwareUpgradeState::REBOOT) {
+    done = passes * STM_FIRMWARE_SIZE_IN_BYTES;
+  }
+  const int8_t progress = std::min<uint32_t>(done * 100 / (passes * STM_FIRMWARE_SIZE_IN_BYTES), 100);
+  if (progress == this->upgrade_progress_) {
+    return;
+  }
+
+  this->upgrade_progress_ = progress;
+  ESP_LOGD(TAG, "STM32 firmware upgrade progress: %d%%", progress);
+  if (this->firmware_upgrade_progress_sensor_ != nullptr) {
+    this->firmware_upgrade_progress_sensor_->publish_state(progress);
+  }
 }
 #endif
 
@@ -265,22 +760,100 @@ uint16_t ShellyDimmer::convert_brightness_(float brightness) {
   return remap<uint16_t, float>(brightness, 0.0f, 1.0f, this->min_brightness_, this->max_brightness_);
 }
 
+void ShellyDimmer::rebuild_brightness_table_() {
+  static_assert(SHELLY_DIMMER_BRIGHTNESS_TABLE_SIZE == SHELLY_DIMMER_MAX_BRIGHTNESS + 1, "Invalid table size");
+
+  // The curve maps normalized power to the brightness it was measured at, entry n at 1 - n / size. Walking it
+  // backwards gives increasing power. Where power stays flat, the highest brightness wins, so the dead zone at the
+  // bottom of the range is skipped.
+  MonotoneSpline<SHELLY_DIMMER_MAX_CALIBRATION_STEPS> curve;
+  for (int n = this->calibration_size_ - 1; n >= 0; n--) {
+    const float power = static_cast<float>(this->calibration_curve_[n]) / Q16_ONE;
+    curve.add(power, 1.0f - static_cast<float>(n) / static_cast<float>(this->calibration_size_));
+  }
+  curve.fit();
+
+  for (size_t i = 0; i < this->brightness_table_.size(); ++i) {
+    float brightness = static_cast<float>(i) / static_cast<float>(SHELLY_DIMMER_MAX_BRIGHTNESS);
+    // Edge values are never remapped.
+    if (curve.size() >= 2 && i != 0 && i != SHELLY_DIMMER_MAX_BRIGHTNESS) {
+      brightness = curve.evaluate(brightness);
+    }
+    this->brightness_table_[i] = this->convert_brightness_(brightness);
+  }
+  ESP_LOGV(TAG, "Rebuilt brightness table");
+}
+
+uint16_t ShellyDimmer::lookup_brightness_(float brightness) const {
+  // Only zero means off, so the smallest non-zero brightness always maps to at least the first step.
+  if (brightness <= 0.0f) {
+    return this->brightness_table_[0];
+  }
+  const long step = std::lround(brightness * static_cast<float>(SHELLY_DIMMER_MAX_BRIGHTNESS));
+  return this->brightness_table_[std::clamp<long>(step, 1, SHELLY_DIMMER_MAX_BRIGHTNESS)];
+}
+
+optional<uint16_t> ShellyDimmer::fade_position_now_() const {
+  if (this->fade_position_rate_ == 0 || !this->brightness_.has_value()) {
+    return {};
+  }
+  const uint16_t target = *this->brightness_;
+  const uint32_t distance =
+      target > this->fade_position_ ? target - this->fade_position_ : this->fade_position_ - target;
+  const uint32_t ticks = std::min((millis() - this->fade_position_time_) / SHELLY_DIMMER_FADE_TICK, distance);
+  const uint32_t moved = ticks * this->fade_position_rate_;
+  if (moved >= distance) {
+    return {};
+  }
+  return target > this->fade_position_ ? this->fade_position_ + moved : this->fade_position_ - moved;
+}
+
 void ShellyDimmer::send_brightness_(uint16_t brightness) {
+  if (this->switch_in_flight_) {
+    // Latest value wins, intermediate values are dropped.
+    if (this->brightness_.has_value() && *this->brightness_ == brightness) {
+      this->pending_brightness_.reset();
+    } else {
+      this->pending_brightness_ = brightness;
+    }
+    return;
+  }
+
   const uint8_t payload[] = {
       // Brightness (%) * 10.
       static_cast<uint8_t>(brightness & 0xff),
       static_cast<uint8_t>(brightness >> 8),
   };
-  static_assert(size(payload) == SHELLY_DIMMER_PROTO_CMD_SWITCH_SIZE, "Invalid payload size");
+  static_assert(std::size(payload) == SHELLY_DIMMER_PROTO_CMD_SWITCH_SIZE, "Invalid payload size");
 
-  this->send_command_(SHELLY_DIMMER_PROTO_CMD_SWITCH, payload, SHELLY_DIMMER_PROTO_CMD_SWITCH_SIZE);
-
-  this->brightness_ = brightness;
+  auto on_complete = [this](bool success) {
+    this->switch_in_flight_ = false;
+    if (!success) {
+      // The STM32 may or may not have applied it, make sure the next write goes out.
+      this->brightness_.reset();
+    }
+    // Send the newest target, if any arrived in the meantime.
+    if (this->pending_brightness_.has_value()) {
+      const uint16_t next = *this->pending_brightness_;
+      this->pending_brightness_.reset();
+      this->send_brightness_(next);
+    }
+  };
+  this->switch_in_flight_ = this->transport_.send_command(SHELLY_DIMMER_PROTO_CMD_SWITCH, payload,
+                                                          SHELLY_DIMMER_PROTO_CMD_SWITCH_SIZE, on_complete);
+  // A dropped command leaves the previous value, so that the same target is sent again.
+  if (this->switch_in_flight_) {
+    // The new fade starts wherever the previous one got to, at the fade rate sent along with it.
+    const optional<uint16_t> position = this->fade_position_now_();
+    this->fade_position_ = position.value_or(this->brightness_.value_or(brightness));
+    this->fade_position_rate_ =
+        this->brightness_.has_value() ? std::min(this->sent_fade_rate_, SHELLY_DIMMER_MAX_FADE_RATE) : 0;
+    this->fade_position_time_ = millis();
+    this->brightness_ = brightness;
+  }
 }
 
 void ShellyDimmer::send_settings_() {
-  const uint16_t fade_rate = std::min(uint16_t{100}, this->fade_rate_);
-
   float brightness = 0.0;
   if (this->state_ != nullptr) {
     this->state_->current_values_as_brightness(&brightness);
@@ -288,6 +861,19 @@ void ShellyDimmer::send_settings_() {
   const uint16_t brightness_int = this->convert_brightness_(brightness);
   ESP_LOGD(TAG, "Brightness update: %d (raw: %f)", brightness_int, brightness);
 
+  // Both go out together, they are acked independently.
+  this->transport_.begin_batch();
+  this->send_settings_frame_(brightness_int, this->fade_rate_);
+
+  // Also send brightness separately as it is ignored above.
+  this->send_brightness_(brightness_int);
+  this->transport_.end_batch();
+}
+
+void ShellyDimmer::send_settings_frame_(uint16_t brightness_int, uint16_t fade_rate) {
+  this->sent_fade_rate_ = fade_rate;
+  fade_rate = std::min(SHELLY_DIMMER_MAX_FADE_RATE, fade_rate);
+
   const uint8_t payload[] = {
       // Brightness (%) * 10.
       static_cast<uint8_t>(brightness_int & 0xff),
@@ -305,146 +891,47 @@ void ShellyDimmer::send_settings_() {
       static_cast<uint8_t>(this->warmup_time_ & 0xff),
       static_cast<uint8_t>(this->warmup_time_ >> 8),
   };
-  static_assert(size(payload) == SHELLY_DIMMER_PROTO_CMD_SETTINGS_SIZE, "Invalid payload size");
-
-  this->send_command_(SHELLY_DIMMER_PROTO_CMD_SETTINGS, payload, SHELLY_DIMMER_PROTO_CMD_SETTINGS_SIZE);
+  static_assert(std::size(payload) == SHELLY_DIMMER_PROTO_CMD_SETTINGS_SIZE, "Invalid payload size");
 
-  // Also send brightness separately as it is ignored above.
-  this->send_brightness_(brightness_int);
+  this->transport_.send_command(SHELLY_DIMMER_PROTO_CMD_SETTINGS, payload, SHELLY_DIMMER_PROTO_CMD_SETTINGS_SIZE);
 }
 
-bool ShellyDimmer::send_command_(uint8_t cmd, const uint8_t *const payload, uint8_t len) {
-  ESP_LOGD(TAG, "Sending command: 0x%02x (%d bytes) payload 0x%s", cmd, len, format_hex(payload, len).c_str());
-
-  // Prepare a command frame.
-  uint8_t frame[SHELLY_DIMMER_PROTO_MAX_FRAME_SIZE];
-  const size_t frame_len = this->frame_command_(frame, cmd, payload, len);
-
-  // Write the frame and wait for acknowledgement.
-  int retries = SHELLY_DIMMER_MAX_RETRIES;
-  while (retries--) {
-    this->write_array(frame, frame_len);
-    this->flush();
-
-    ESP_LOGD(TAG, "Command sent, waiting for reply");
-    const uint32_t tx_time = millis();
-    while (millis() - tx_time < SHELLY_DIMMER_ACK_TIMEOUT) {
-      if (this->read_frame_()) {
-        return true;
-      }
-      delay(1);
+void ShellyDimmer::publish_link_statistics_() {
+  ShellyTransport::LinkStats &stats = this->transport_.stats();
+  const auto publish = [this](LinkStatistic statistic, float value) {
+    sensor::Sensor *sensor = this->link_statistic_sensors_[statistic];
+    if (sensor != nullptr) {
+      sensor->publish_state(value);
     }
-    ESP_LOGW(TAG, "Timeout while waiting for reply");
-  }
-  ESP_LOGW(TAG, "Failed to send command");
-  return false;
-}
-
-size_t ShellyDimmer::frame_command_(uint8_t *data, uint8_t cmd, const uint8_t *const payload, size_t len) {
-  size_t pos = 0;
-
-  // Generate a frame.
-  data[0] = SHELLY_DIMMER_PROTO_START_BYTE;
-  data[1] = ++this->seq_;
-  data[2] = cmd;
-  data[3] = len;
-  pos += 4;
-
-  if (payload != nullptr) {
-    std::memcpy(data + 4, payload, len);
-    pos += len;
-  }
-
-  // Calculate checksum for the payload.
-  const uint16_t csum = shelly_dimmer_checksum(data + 1, 3 + len);
-  data[pos++] = static_cast<uint8_t>(csum >> 8);
-  data[pos++] = static_cast<uint8_t>(csum & 0xff);
-  data[pos++] = SHELLY_DIMMER_PROTO_END_BYTE;
-  return pos;
-}
-
-int ShellyDimmer::handle_byte_(uint8_t c) {
-  const uint8_t pos = this->buffer_pos_;
-
-  if (pos == 0) {
-    // Must be start byte.
-    return c == SHELLY_DIMMER_PROTO_START_BYTE ? 1 : -1;
-  } else if (pos < 4) {
-    // Header.
-    return 1;
-  }
-
-  // Decode payload length from header.
-  const uint8_t payload_len = this->buffer_[3];
-  if ((4 + payload_len + 3) > SHELLY_DIMMER_BUFFER_SIZE) {
-    return -1;
-  }
-
-  if (pos < 4 + payload_len + 1) {
-    // Payload.
-    return 1;
-  }
-
-  if (pos == 4 + payload_len + 1) {
-    // Verify checksum.
-    const uint16_t csum = (this->buffer_[pos - 1] << 8 | c);
-    const uint16_t csum_verify = shelly_dimmer_checksum(&this->buffer_[1], 3 + payload_len);
-    if (csum != csum_verify) {
-      return -1;
-    }
-    return 1;
-  }
-
-  if (pos == 4 + payload_len + 2) {
-    // Must be end byte.
-    return c == SHELLY_DIMMER_PROTO_END_BYTE ? 0 : -1;
-  }
-  return -1;
-}
-
-bool ShellyDimmer::read_frame_() {
-  while (this->available()) {
-    const uint8_t c = this->read();
-    this->buffer_[this->buffer_pos_] = c;
+  };
 
-    ESP_LOGV(TAG, "Read byte: 0x%02x (pos %d)", c, this->buffer_pos_);
+  publish(LINK_STATISTIC_FRAMES_SENT, stats.frames_sent);
+  publish(LINK_STATISTIC_RETRIES, stats.retries);
+  publish(LINK_STATISTIC_TIMEOUTS, stats.timeouts);
+  publish(LINK_STATISTIC_CHECKSUM_ERRORS, stats.checksum_errors);
+  publish(LINK_STATISTIC_FRAMING_ERRORS, stats.framing_errors);
+  publish(LINK_STATISTIC_SEQUENCE_MISMATCHES, stats.sequence_mismatches);
 
-    switch (this->handle_byte_(c)) {
-      case 0: {
-        // Frame successfully received.
-        this->handle_frame_();
-        this->buffer_pos_ = 0;
-        return true;
-      }
-      case -1: {
-        // Failure.
-        this->buffer_pos_ = 0;
-        break;
-      }
-      case 1: {
-        // Need more data.
-        this->buffer_pos_++;
-        break;
-      }
-    }
+  if (stats.latency_count == 0) {
+    return;
   }
-  return false;
+  ESP_LOGV(TAG, "Ack latency: min %u ms, avg %u ms, max %u ms over %u replies", stats.latency_min,
+           stats.latency_sum / stats.latency_count, stats.latency_max, stats.latency_count);
+  publish(LINK_STATISTIC_ACK_LATENCY_MIN, stats.latency_min);
+  publish(LINK_STATISTIC_ACK_LATENCY_AVG, static_cast<float>(stats.latency_sum) / stats.latency_count);
+  publish(LINK_STATISTIC_ACK_LATENCY_MAX, stats.latency_max);
+  publish(LINK_STATISTIC_ACK_LATENCY_P95, this->transport_.ack_latency_percentile(95));
+
+  // Latency is reported per update interval.
+  stats.latency_count = 0;
+  stats.latency_sum = 0;
+  stats.latency_min = 0;
+  stats.latency_max = 0;
+  stats.latency_histogram.fill(0);
 }
 
-bool ShellyDimmer::handle_frame_() {
-  const uint8_t seq = this->buffer_[1];
-  const uint8_t cmd = this->buffer_[2];
-  const uint8_t payload_len = this->buffer_[3];
-
-  ESP_LOGD(TAG, "Got frame: 0x%02x", cmd);
-
-  // Compare with expected identifier as the frame is always a response to
-  // our previously sent command.
-  if (seq != this->seq_) {
-    return false;
-  }
-
-  const uint8_t *payload = &this->buffer_[4];
+bool ShellyDimmer::handle_frame_(uint8_t cmd, const uint8_t *payload, uint8_t payload_len) {
+  ESP_LOGV(TAG, "Got frame: 0x%02x", cmd);
 
   // Handle response.
   switch (cmd) {
@@ -463,7 +950,20 @@ bool ShellyDimmer::handle_frame_() {
 
       const uint32_t current_raw = encode_uint32(payload[15], payload[14], payload[13], payload[12]);
 
-      const uint16_t fade_rate = payload[16];
+      // Current fade rate, non-zero while the firmware is fading towards the target brightness.
+      const uint16_t fade_rate = payload_len > 16 ? payload[16] : 0;
+      this->fade_position_ = brightness;
+      this->fade_position_rate_ = fade_rate;
+      this->fade_position_time_ = millis();
+
+      // Fast path for an idle dimmer: nothing to convert or publish when none of the raw counters changed.
+      // During calibration every poll counts as a measurement, so it always goes through.
+      if (this->publish_on_change_ && this->sample_interval_ == 0 && !this->calibrating_ &&
+          this->power_filter_.matches(power_raw) &&
+          this->voltage_filter_.matches(voltage_raw) && this->current_filter_.matches(current_raw)) {
+        ESP_LOGV(TAG, "Dimmer data unchanged");
+        return true;
+      }
 
       float power = 0;
       if (power_raw > 0) {
@@ -480,6 +980,19 @@ bool ShellyDimmer::handle_frame_() {
         current = CURRENT_SCALING_FACTOR / static_cast<float>(current_raw);
       }
 
+      this->last_power_ = power;
+
+      // Fast samples are only aggregated, they get published once per update interval.
+      if (this->sample_interval_ != 0 && !this->calibrating_) {
+        ESP_LOGV(TAG, "Sample: %.1f W, %.1f V, %.2f A", power, voltage, current);
+        this->accumulate_sample_(power, voltage, current);
+        return true;
+      }
+
+#ifdef USE_SHD_COMPACT_LOG
+      ESP_LOGD(TAG, "Dimmer data: hw %d, brightness %d, fade rate %d, %.1f W, %.1f V, %.2f A", hw_version, brightness,
+               fade_rate, power, voltage, current);
+#else
       ESP_LOGD(TAG, "Got dimmer data:");
       ESP_LOGD(TAG, "  HW version: %d", hw_version);
       ESP_LOGD(TAG, "  Brightness: %d", brightness);
@@ -487,17 +1000,12 @@ bool ShellyDimmer::handle_frame_() {
       ESP_LOGD(TAG, "  Power:      %f W", power);
       ESP_LOGD(TAG, "  Voltage:    %f V", voltage);
       ESP_LOGD(TAG, "  Current:    %f A", current);
+#endif
 
       // Update sensors.
-      if (this->power_sensor_ != nullptr) {
-        this->power_sensor_->publish_state(power);
-      }
-      if (this->voltage_sensor_ != nullptr) {
-        this->voltage_sensor_->publish_state(voltage);
-      }
-      if (this->current_sensor_ != nullptr) {
-        this->current_sensor_->publish_state(current);
-      }
+      this->publish_measurement_(this->power_sensor_, this->power_filter_, power_raw, power);
+      this->publish_measurement_(this->voltage_sensor_, this->voltage_filter_, voltage_raw, voltage);
+      this->publish_measurement_(this->current_sensor_, this->current_filter_, current_raw, current);
 
       return true;
     }
@@ -520,6 +1028,27 @@ bool ShellyDimmer::handle_frame_() {
   }
 }
 
+void ShellyDimmer::publish_measurement_(sensor::Sensor *sensor, MeasurementFilter &filter, uint32_t raw,
+                                        float value) {
+  const bool unchanged = filter.matches(raw);
+  filter.last_raw = raw;
+  filter.valid = true;
+  if (sensor == nullptr) {
+    return;
+  }
+
+  // Calibration needs the latest value in the sensor state, and the first value always goes out.
+  if (!this->calibrating_ && sensor->has_state()) {
+    if (this->publish_on_change_ && unchanged) {
+      return;
+    }
+    if (filter.deadband > 0 && std::fabs(value - sensor->get_raw_state()) <= filter.deadband) {
+      return;
+    }
+  }
+  sensor->publish_state(value);
+}
+
 void ShellyDimmer::reset_(bool boot0) {
   ESP_LOGD(TAG, "Reset STM32, boot0=%d", boot0);
 
@@ -544,9 +1073,9 @@ void ShellyDimmer::reset_(bool boot0) {
 void ShellyDimmer::reset_normal_boot_() {
   // set NONE parity in normal mode
 
-#ifndef USE_ESP_IDF  // workaround for reconfiguring the uart
+#ifdef USE_ESP8266  // workaround for reconfiguring the uart
   Serial.end();
-  Serial.begin(115200, SERIAL_8N1);
+  Serial.begin(SHELLY_DIMMER_BAUD_RATE, SERIAL_8N1);
   Serial.flush();
 #endif
 
@@ -554,70 +1083,125 @@ void ShellyDimmer::reset_normal_boot_() {
   this->reset_(false);
 }
 
-void ShellyDimmer::reset_dfu_boot_() {
+#ifdef USE_SHD_FIRMWARE_DATA
+void ShellyDimmer::reset_dfu_boot_(uint32_t baud_rate) {
   // set EVEN parity in bootloader mode
+  ESP_LOGD(TAG, "Using %u baud for the STM32 bootloader", baud_rate);
 
-#ifndef USE_ESP_IDF  // workaround for reconfiguring the uart
+#ifdef USE_ESP8266  // workaround for reconfiguring the uart
   Serial.end();
-  Serial.begin(115200, SERIAL_8E1);
+  Serial.begin(baud_rate, SERIAL_8E1);
   Serial.flush();
 #endif
 
   this->flush();
   this->reset_(true);
 }
+#endif
 
 void ShellyDimmer::start_calibration() {
-  ESP_LOGD(TAG, "Setting update interval to 1 second");
-  this->update_interval_original_ = this->get_update_interval();
-  this->stop_poller();
-  this->set_update_interval(1000);
-  this->start_poller();
-
-  ESP_LOGI(TAG, "Starting calibration");
-  // Turn on the light, disable transition, set max brightness
-  this->set_brightness_no_transition_(1);
+  ESP_LOGI(TAG, "Starting calibration: %d steps of up to %d samples", this->calibration_steps_,
+           this->calibration_samples_);
 
   // Init calibration data
   this->calibration_data_.fill(0);
-  this->calibration_measurements_.fill(0);
-  this->calibration_measurement_cnt_ = 0;
-  this->calibration_step_ = -20;
+  this->calibration_curve_.fill(0);
+  this->calibration_size_ = 0;
+  this->rebuild_brightness_table_();
+  this->begin_calibration_(0);
+}
+
+void ShellyDimmer::begin_calibration_(uint8_t step) {
   this->calibrating_ = true;
+  this->calibration_step_ = step;
+  this->calibration_measurement_cnt_ = 0;
+  this->calibration_start_time_ = millis();
+  this->calibration_settling_ = true;
+  this->calibration_poll_pending_ = false;
+
+  // Turn on the light, disable transition, set the brightness of this step.
+  this->set_brightness_no_transition_(this->calibration_step_brightness_(step));
+
+  // Calibration has its own timer, the regular update interval is left alone.
+  this->set_interval("calibration", this->calibration_interval_, [this]() { this->poll_calibration_(); });
+}
+
+float ShellyDimmer::calibration_step_brightness_(uint8_t step) const {
+  return 1.0f - static_cast<float>(step) / static_cast<float>(this->calibration_steps_);
+}
+
+void ShellyDimmer::poll_calibration_() {
+  if (this->calibration_poll_pending_) {
+    return;
+  }
+  this->calibration_poll_pending_ =
+      this->transport_.send_command(SHELLY_DIMMER_PROTO_CMD_POLL, nullptr, 0, [this](bool success) {
+        this->calibration_poll_pending_ = false;
+        if (success && this->calibrating_) {
+          this->perform_calibration_measurement_();
+        }
+      });
 }
 
 void ShellyDimmer::perform_calibration_measurement_() {
-  if (!this->power_sensor_->has_state())  // Wait for power sensor to receive data
+  if (std::isnan(this->last_power_))  // Wait for power readings
     return;
 
-  if (this->calibration_step_ < 0) {
-    ESP_LOGD(TAG, "Calibration warmup. Steps till calibration: %d", -this->calibration_step_);
-    this->calibration_step_++;
-    if (this->calibration_step_ == 0) {
-      ESP_LOGD(TAG, "Calibration warmup complete");
-    }
+  const uint32_t elapsed = millis() - this->calibration_start_time_;
+  if (elapsed < this->calibration_warmup_) {
+    ESP_LOGD(TAG, "Calibration warmup. Seconds till calibration: %u", (this->calibration_warmup_ - elapsed) / 1000);
     return;
   }
 
-  ESP_LOGD(TAG, "Calibration step %d, measurement %d", this->calibration_step_ + 1,
-           this->calibration_measurement_cnt_ + 1);
+  // The first reading after a brightness change may still reflect the previous level.
+  if (this->calibration_settling_) {
+    this->calibration_settling_ = false;
+    return;
+  }
 
-  this->calibration_measurements_[this->calibration_measurement_cnt_] = this->power_sensor_->state;
+  ESP_LOGD(TAG, "Calibration step %d, measurement %d: %f", this->calibration_step_ + 1,
+           this->calibration_measurement_cnt_ + 1, this->last_power_);
+
+  this->calibration_measurements_[this->calibration_measurement_cnt_] = this->last_power_;
   this->calibration_measurement_cnt_++;
 
-  if ((uint32_t) this->calibration_measurement_cnt_ >= this->calibration_measurements_.size()) {
+  if (this->calibration_measurement_cnt_ >= this->calibration_samples_ || this->calibration_stable_()) {
     this->complete_calibration_step_();
   }
 }
 
-void ShellyDimmer::complete_calibration_step_() {
-  // Calculate mean power across measurements at this step
-  float result = 0;
-  for (float measurement : this->calibration_measurements_) {
-    result += measurement;
+float ShellyDimmer::calibration_mean_() const {
+  float sum = 0;
+  for (uint8_t i = 0; i < this->calibration_measurement_cnt_; i++) {
+    sum += this->calibration_measurements_[i];
+  }
+  return sum / static_cast<float>(this->calibration_measurement_cnt_);
+}
+
+bool ShellyDimmer::calibration_stable_() const {
+  if (this->calibration_stability_threshold_ <= 0 || this->calibration_measurement_cnt_ < 2) {
+    return false;
+  }
+
+  const float mean = this->calibration_mean_();
+  float variance = 0;
+  for (uint8_t i = 0; i < this->calibration_measurement_cnt_; i++) {
+    const float deviation = this->calibration_measurements_[i] - mean;
+    variance += deviation * deviation;
+  }
+  variance /= static_cast<float>(this->calibration_measurement_cnt_ - 1);
+
+  // The threshold is a standard deviation, in W.
+  const bool stable = variance <= this->calibration_stability_threshold_ * this->calibration_stability_threshold_;
+  if (stable) {
+    ESP_LOGD(TAG, "Readings stable after %d measurements", this->calibration_measurement_cnt_);
   }
+  return stable;
+}
 
-  result = result / (float) this->calibration_measurements_.size();
+void ShellyDimmer::complete_calibration_step_() {
+  // Calculate mean power across measurements at this step
+  const float result = this->calibration_mean_();
 
   ESP_LOGD(TAG, "Mean power at step %d: %f", this->calibration_step_ + 1, result);
 
@@ -625,55 +1209,149 @@ void ShellyDimmer::complete_calibration_step_() {
   this->calibration_data_[this->calibration_step_] = result;
   this->calibration_step_++;
   this->calibration_measurement_cnt_ = 0;
-  this->calibration_measurements_.fill(0);
+  this->calibration_settling_ = true;
 
   // If all measurements collected, finish calibration
-  if ((uint32_t) this->calibration_step_ >= this->calibration_data_.size()) {
+  if (this->calibration_step_ >= this->calibration_steps_) {
     this->complete_calibration_();
     return;
   }
 
+  this->save_calibration_checkpoint_();
+
   // Decrease brightness for next set of measurements
-  float cur_brightness = 0;
-  this->state_->current_values_as_brightness(&cur_brightness);
-  this->set_brightness_no_transition_(cur_brightness - CALIBRATION_STEP);
+  this->set_brightness_no_transition_(this->calibration_step_brightness_(this->calibration_step_));
 }
 
 void ShellyDimmer::complete_calibration_() {
+  this->cancel_interval("calibration");
   this->calibrating_ = false;
 
-  // Sort the values, since power readings can be jittery due to voltage fluctuations
-  std::sort(this->calibration_data_.begin(), this->calibration_data_.end(), std::greater{});
+  // Power readings can be jittery due to voltage fluctuations, fit a non-increasing curve through them
+  pool_adjacent_violators(this->calibration_data_.data(), this->calibration_steps_);
 
   // Normalize values in the range of [0..1]
   float max = this->calibration_data_[0];
-  float min = this->calibration_data_[this->calibration_data_.size() - 1];
-  for (float &value : this->calibration_data_) {
-    value = remap(value, min, max, 0.0f, 1.0f);
+  float min = this->calibration_data_[this->calibration_steps_ - 1];
+  if (max <= min) {
+    ESP_LOGW(TAG, "Calibration failed, power did not change with brightness");
+    this->clear_calibration();
+    this->set_brightness_no_transition_(1);
+    return;
+  }
+  for (uint8_t i = 0; i < this->calibration_steps_; i++) {
+    this->calibration_curve_[i] = to_q16(remap(this->calibration_data_[i], min, max, 0.0f, 1.0f));
   }
+  this->calibration_size_ = this->calibration_steps_;
 
+  // Replaces the saved progress of the run.
   this->save_calibration_();
+  this->rebuild_brightness_table_();
 
   ESP_LOGD(TAG, "Finished calibration. Values:");
-  for (float value : this->calibration_data_) {
-    ESP_LOGD(TAG, "%f", value);
+  for (uint8_t i = 0; i < this->calibration_size_; i++) {
+    ESP_LOGD(TAG, "%.1f W -> %u", this->calibration_data_[i], this->calibration_curve_[i]);
   }
 
   this->set_brightness_no_transition_(1);
+}
 
-  uint32_t update_interval = this->update_interval_original_ == 0 ? 10000 : this->update_interval_original_;
-  ESP_LOGD(TAG, "Reverting update interval to %d seconds", update_interval / 1000);
-  this->stop_poller();
-  this->set_update_interval(update_interval);
-  this->start_poller();
+uint16_t ShellyDimmer::calibration_checksum_(const CalibrationData &data) {
+  const uint8_t header[] = {data.version, data.size, data.step};
+  const uint16_t checksum = fletcher16(header, sizeof(header));
+  return fletcher16(reinterpret_cast<const uint8_t *>(data.values.data()), data.size * sizeof(uint16_t), checksum);
 }
+
+void ShellyDimmer::load_calibration_() {
+  CalibrationData data{};
+  if (this->rtc_.load(&data)) {
+    if (data.version != CALIBRATION_FORMAT_VERSION || data.size > SHELLY_DIMMER_MAX_CALIBRATION_STEPS ||
+        data.checksum != calibration_checksum_(data)) {
+      ESP_LOGW(TAG, "Ignoring invalid calibration data");
+      return;
+    }
+    if (data.step != 0) {
+      // Measurements of an interrupted run, picked up by resume_calibration_().
+      return;
+    }
+    this->calibration_size_ = data.size;
+    this->calibration_curve_ = data.values;
+  } else {
+    // Calibration saved by versions with a fixed 20 step calibration.
+    std::array<float, 20> legacy{};
+    ESPPreferenceObject legacy_rtc = global_preferences->make_preference<std::array<float, 20>>(
+        this->state_->get_object_id_hash() ^ LEGACY_RESTORE_STATE_VERSION);
+    if (!legacy_rtc.load(&legacy) || legacy[0] == 0) {
+      return;
+    }
+    std::transform(legacy.begin(), legacy.end(), this->calibration_curve_.begin(), to_q16);
+    this->calibration_size_ = legacy.size();
+    // Rewrite in the current format, so the legacy entry isn't needed anymore.
+    this->save_calibration_();
+  }
+
+  if (this->calibration_size_ != 0) {
+    ESP_LOGD(TAG, "Loaded calibration with %d points from flash", this->calibration_size_);
+  }
+}
+
 void ShellyDimmer::save_calibration_() {
-  if (this->rtc_.save(&this->calibration_data_)) {
+  CalibrationData data{};
+  data.version = CALIBRATION_FORMAT_VERSION;
+  data.size = this->calibration_size_;
+  std::copy_n(this->calibration_curve_.begin(), this->calibration_size_, data.values.begin());
+  data.checksum = calibration_checksum_(data);
+  if (this->rtc_.save(&data)) {
     ESP_LOGD(TAG, "Saved calibration to flash");
   } else {
     ESP_LOGW(TAG, "Couldn't save calibration to flash");
   }
 }
+
+void ShellyDimmer::resume_calibration_() {
+  CalibrationData data{};
+  if (!this->rtc_.load(&data) || data.version != CALIBRATION_FORMAT_VERSION ||
+      data.size > SHELLY_DIMMER_MAX_CALIBRATION_STEPS || data.checksum != calibration_checksum_(data)) {
+    return;
+  }
+  switch (calibration_resume_action(data.size, data.step, this->calibration_steps_)) {
+    case CalibrationResume::NONE:
+      return;
+    case CalibrationResume::DISCARD:
+      ESP_LOGW(TAG, "Discarding interrupted calibration of %d steps, %d steps are configured", data.size,
+               this->calibration_steps_);
+      // Otherwise the stale run would keep the dimmer uncalibrated on every boot.
+      this->save_calibration_();
+      return;
+    case CalibrationResume::CONTINUE:
+      break;
+  }
+
+  ESP_LOGI(TAG, "Resuming calibration at step %d of %d", data.step + 1, data.size);
+  this->calibration_data_.fill(0);
+  for (uint8_t i = 0; i < data.step; i++) {
+    this->calibration_data_[i] = static_cast<float>(data.values[i]) / CALIBRATION_POWER_SCALE;
+  }
+  this->calibration_size_ = 0;
+  this->rebuild_brightness_table_();
+  this->begin_calibration_(data.step);
+}
+
+void ShellyDimmer::save_calibration_checkpoint_() {
+  CalibrationData data{};
+  data.version = CALIBRATION_FORMAT_VERSION;
+  data.size = this->calibration_steps_;
+  data.step = this->calibration_step_;
+  for (uint8_t i = 0; i < this->calibration_step_; i++) {
+    const float power = std::clamp(this->calibration_data_[i] * CALIBRATION_POWER_SCALE, 0.0f, 65535.0f);
+    data.values[i] = static_cast<uint16_t>(std::lround(power));
+  }
+  data.checksum = calibration_checksum_(data);
+  if (!this->rtc_.save(&data)) {
+    ESP_LOGW(TAG, "Couldn't save calibration checkpoint");
+  }
+}
+
 void ShellyDimmer::set_brightness_no_transition_(float brightness) {
   auto call = this->state_->make_call();
   call.set_brightness(brightness);
@@ -682,11 +1360,17 @@ void ShellyDimmer::set_brightness_no_transition_(float brightness) {
   call.perform();
 }
 void ShellyDimmer::clear_calibration() {
+  if (this->calibrating_) {
+    ESP_LOGI(TAG, "Aborting calibration");
+    this->cancel_interval("calibration");
+    this->calibrating_ = false;
+  }
   this->calibration_data_.fill(0);
+  this->calibration_curve_.fill(0);
+  this->calibration_size_ = 0;
   this->save_calibration_();
+  this->rebuild_brightness_table_();
 }
 
 }  // namespace shelly_dimmer
 }  // namespace esphome
-
-#endif  // USE_ESP8266
@@ -1,29 +1,120 @@
 #pragma once
 
-#ifdef USE_ESP8266
-
 #include "esphome/core/component.h"
+#include "esphome/core/helpers.h"
 #include "esphome/core/log.h"
+#include "esphome/core/optional.h"
 #include "esphome/components/light/light_output.h"
 #include "esphome/components/sensor/sensor.h"
 #include "esphome/components/uart/uart.h"
+#include "stm32flash.h"
+#include "transport.h"
 
 #include <algorithm>
 #include <array>
+#include <cmath>
+#include <functional>
+#include <memory>
 
 namespace esphome {
 namespace shelly_dimmer {
 
+/// Where light transitions are rendered.
+enum TransitionMode {
+  /// ESPHome interpolates and streams intermediate brightness values.
+  TRANSITION_MODE_ESP = 0,
+  /// The STM32 firmware fades to a single target brightness at a computed fade rate.
+  TRANSITION_MODE_FIRMWARE,
+};
+
+/// UART link statistics that can be published as sensors.
+enum LinkStatistic : uint8_t {
+  LINK_STATISTIC_FRAMES_SENT = 0,
+  LINK_STATISTIC_RETRIES,
+  LINK_STATISTIC_TIMEOUTS,
+  LINK_STATISTIC_CHECKSUM_ERRORS,
+  LINK_STATISTIC_FRAMING_ERRORS,
+  LINK_STATISTIC_SEQUENCE_MISMATCHES,
+  // Ack latency over the last update interval.
+  LINK_STATISTIC_ACK_LATENCY_MIN,
+  LINK_STATISTIC_ACK_LATENCY_AVG,
+  LINK_STATISTIC_ACK_LATENCY_MAX,
+  LINK_STATISTIC_ACK_LATENCY_P95,
+  LINK_STATISTIC_COUNT,
+};
+
+#ifdef USE_SHD_FIRMWARE_DATA
+/// Steps of a firmware upgrade, one is advanced per loop() iteration.
+enum class FirmwareUpgradeState : uint8_t {
+  IDLE = 0,
+  /// Boot the STM32 into its bootloader and connect to it.
+  INIT,
+  /// Mass erase the flash before writing the whole image.
+  ERASE,
+  /// Compare a single flash page with the image, erasing it when it differs.
+  COMPARE,
+  /// Write a range of the image, without blocking on the acks.
+  WRITE,
+  /// Boot the new firmware and check its version.
+  REBOOT,
+};
+#endif
+
+class ShellyDimmerTransformer;
+
 class ShellyDimmer : public PollingComponent, public light::LightOutput, public uart::UARTDevice {
  private:
-  static constexpr uint16_t SHELLY_DIMMER_BUFFER_SIZE = 256;
+  // One entry per output step, 0..1000 (100%).
+  static constexpr uint16_t SHELLY_DIMMER_BRIGHTNESS_TABLE_SIZE = 1001;
+  static constexpr uint8_t SHELLY_DIMMER_MAX_CALIBRATION_STEPS = 32;
+  static constexpr uint8_t SHELLY_DIMMER_MAX_CALIBRATION_SAMPLES = 10;
+
+  /// Publish filter of a POLL measurement.
+  struct MeasurementFilter {
+    // Minimum change (in sensor units) before a new value is published, 0 publishes every change.
+    float deadband;
+    uint32_t last_raw;
+    bool valid;
+
+    bool matches(uint32_t raw) const { return this->valid && raw == this->last_raw; }
+  };
+
+  /// Aggregates of the fast sampled POLL measurements over one update interval.
+  struct SampleAggregate {
+    uint32_t count;
+    float power_sum;
+    float power_min;
+    float power_max;
+    float voltage_sum;
+    float current_sum;
+    // Previous sample, for integrating energy.
+    bool have_last;
+    float last_power;
+    uint32_t last_time;
+  };
+
+  /// Calibration curve as stored in flash: normalized power at brightness 1 - n / size in Q0.16, 65535 being 1.
+  /// While a calibration run is in progress the same record holds its measurements instead, so a reboot resumes it.
+  struct CalibrationData {
+    uint8_t version;
+    // Number of points, 0 when uncalibrated. Number of steps of the run while one is in progress.
+    uint8_t size;
+    // Next step to measure of a run in progress, 0 when values is a finished curve.
+    uint8_t step;
+    // Fletcher-16 over version, size, step and the used points.
+    uint16_t checksum;
+    // Curve points, or the power measured at each step of the run in 0.1 W.
+    std::array<uint16_t, SHELLY_DIMMER_MAX_CALIBRATION_STEPS> values;
+  };
 
  public:
-  float get_setup_priority() const override { return setup_priority::LATE; }
+  // Right after the light state restored its values (HARDWARE - 1), well before WiFi.
+  float get_setup_priority() const override { return setup_priority::HARDWARE - 2.0f; }
 
   bool is_running_configured_version() const;
   void handle_firmware();
   void setup() override;
+  void loop() override;
   void update() override;
   void dump_config() override;
 
@@ -35,20 +126,49 @@ class ShellyDimmer : public PollingComponent, public light::LightOutput, public
 
   void setup_state(light::LightState *state) override { this->state_ = state; }
   void write_state(light::LightState *state) override;
+  std::unique_ptr<light::LightTransformer> create_default_transition() override;
 
   void set_nrst_pin(GPIOPin *nrst_pin) { this->pin_nrst_ = nrst_pin; }
   void set_boot0_pin(GPIOPin *boot0_pin) { this->pin_boot0_ = boot0_pin; }
+#ifdef USE_SHD_FIRMWARE_DATA
+  void set_differential_flash(bool differential_flash) { this->differential_flash_ = differential_flash; }
+  void set_verify_flash(bool verify_flash) { this->verify_flash_ = verify_flash; }
+  void set_dfu_baud_rate(uint32_t dfu_baud_rate) { this->dfu_baud_rate_ = dfu_baud_rate; }
+#endif
 
+  void set_warm_start(bool warm_start) { this->warm_start_ = warm_start; }
   void set_leading_edge(bool leading_edge) { this->leading_edge_ = leading_edge; }
   void set_warmup_brightness(uint16_t warmup_brightness) { this->warmup_brightness_ = warmup_brightness; }
   void set_warmup_time(uint16_t warmup_time) { this->warmup_time_ = warmup_time; }
   void set_fade_rate(uint16_t fade_rate) { this->fade_rate_ = fade_rate; }
+  void set_transition_mode(TransitionMode transition_mode) { this->transition_mode_ = transition_mode; }
   void set_min_brightness(uint16_t min_brightness) { this->min_brightness_ = min_brightness; }
   void set_max_brightness(uint16_t max_brightness) { this->max_brightness_ = max_brightness; }
 
   void set_power_sensor(sensor::Sensor *power_sensor) { this->power_sensor_ = power_sensor; }
   void set_voltage_sensor(sensor::Sensor *voltage_sensor) { this->voltage_sensor_ = voltage_sensor; }
   void set_current_sensor(sensor::Sensor *current_sensor) { this->current_sensor_ = current_sensor; }
+  void set_power_deadband(float deadband) { this->power_filter_.deadband = deadband; }
+  void set_voltage_deadband(float deadband) { this->voltage_filter_.deadband = deadband; }
+  void set_current_deadband(float deadband) { this->current_filter_.deadband = deadband; }
+  void set_publish_on_change(bool publish_on_change) { this->publish_on_change_ = publish_on_change; }
+  void set_sample_interval(uint32_t sample_interval) { this->sample_interval_ = sample_interval; }
+  void set_power_min_sensor(sensor::Sensor *power_min_sensor) { this->power_min_sensor_ = power_min_sensor; }
+  void set_power_max_sensor(sensor::Sensor *power_max_sensor) { this->power_max_sensor_ = power_max_sensor; }
+  void set_energy_sensor(sensor::Sensor *energy_sensor) { this->energy_sensor_ = energy_sensor; }
+  void set_calibration_steps(uint8_t steps) { this->calibration_steps_ = steps; }
+  void set_calibration_samples(uint8_t samples) { this->calibration_samples_ = samples; }
+  void set_calibration_interval(uint32_t interval) { this->calibration_interval_ = interval; }
+  void set_calibration_warmup(uint32_t warmup) { this->calibration_warmup_ = warmup; }
+  void set_calibration_stability_threshold(float threshold) { this->calibration_stability_threshold_ = threshold; }
+  void set_link_statistic_sensor(LinkStatistic statistic, sensor::Sensor *sensor) {
+    this->link_statistic_sensors_[statistic] = sensor;
+  }
+#ifdef USE_SHD_FIRMWARE_DATA
+  void set_firmware_upgrade_progress_sensor(sensor::Sensor *firmware_upgrade_progress_sensor) {
+    this->firmware_upgrade_progress_sensor_ = firmware_upgrade_progress_sensor;
+  }
+#endif
 
   /// Starts the calibration process.
   void start_calibration();
@@ -60,20 +180,27 @@ class ShellyDimmer : public PollingComponent, public light::LightOutput, public
   GPIOPin *pin_nrst_;
   GPIOPin *pin_boot0_;
 
-  // Frame parser state.
-  uint8_t seq_{0};
-  std::array<uint8_t, SHELLY_DIMMER_BUFFER_SIZE> buffer_;
-  uint8_t buffer_pos_{0};
+  // Command transport to the STM32 on this UART.
+  ShellyTransport transport_{this, [this](uint8_t cmd, const uint8_t *payload, uint8_t len) {
+                               return this->handle_frame_(cmd, payload, len);
+                             }};
 
   // Firmware version.
-  uint8_t version_major_;
-  uint8_t version_minor_;
+  uint8_t version_major_{0};
+  uint8_t version_minor_{0};
 
   // Configuration.
+#ifdef USE_SHD_FIRMWARE_DATA
+  bool differential_flash_{false};
+  bool verify_flash_{false};
+  uint32_t dfu_baud_rate_{115200};
+#endif
+  bool warm_start_{true};
   bool leading_edge_{false};
   uint16_t warmup_brightness_{100};
   uint16_t warmup_time_{20};
   uint16_t fade_rate_{0};
+  TransitionMode transition_mode_{TRANSITION_MODE_ESP};
   uint16_t min_brightness_{0};
   uint16_t max_brightness_{1000};
 
@@ -81,73 +208,226 @@ class ShellyDimmer : public PollingComponent, public light::LightOutput, public
   sensor::Sensor *power_sensor_{nullptr};
   sensor::Sensor *voltage_sensor_{nullptr};
   sensor::Sensor *current_sensor_{nullptr};
-
+  bool publish_on_change_{false};
+  MeasurementFilter power_filter_{};
+  MeasurementFilter voltage_filter_{};
+  MeasurementFilter current_filter_{};
+
+  // Fast sampling, disabled when the interval is 0.
+  uint32_t sample_interval_{0};
+  uint32_t last_sample_time_{0};
+  bool sample_pending_{false};
+  SampleAggregate samples_{};
+  double energy_{0};  // Wh
+  sensor::Sensor *power_min_sensor_{nullptr};
+  sensor::Sensor *power_max_sensor_{nullptr};
+  sensor::Sensor *energy_sensor_{nullptr};
+  std::array<sensor::Sensor *, LINK_STATISTIC_COUNT> link_statistic_sensors_{};
+
+#ifdef USE_SHD_FIRMWARE_DATA
+  // Firmware upgrade state.
+  FirmwareUpgradeState upgrade_state_{FirmwareUpgradeState::IDLE};
+  stm32_unique_ptr stm32_{nullptr, nullptr};
+  // Image offset of the flash page being compared.
+  uint32_t upgrade_offset_{0};
+  uint32_t upgrade_page_{0};
+  uint8_t upgrade_attempts_{0};
+  // Image range being written and the incremental write in progress.
+  uint32_t upgrade_write_pos_{0};
+  uint32_t upgrade_write_end_{0};
+  std::unique_ptr<stm32_write_t> upgrade_write_{};
+  HighFrequencyLoopRequester high_freq_;
+  bool upgrade_full_write_{false};
+  bool upgrade_verifying_{false};
+  int8_t upgrade_progress_{-1};
+  sensor::Sensor *firmware_upgrade_progress_sensor_{nullptr};
+#endif
+
+  // Whether the firmware version is known without a reset, and whether the firmware still needs checking.
+  bool version_probed_{false};
+  bool firmware_check_pending_{false};
   bool ready_{false};
-  uint16_t brightness_;
+  // Last brightness queued to the STM32, unknown until sent and after a SWITCH failed.
+  optional<uint16_t> brightness_{};
+  // Brightness write coalescing: at most one SWITCH in flight, the newest target waits here.
+  bool switch_in_flight_{false};
+  optional<uint16_t> pending_brightness_{};
+  // Fade rate last sent to the STM32 and the one requested by an active firmware transition.
+  uint16_t sent_fade_rate_{0};
+  optional<uint16_t> transition_fade_rate_{};
+  // Fade progress of the STM32: its brightness at fade_position_time_, moving towards brightness_ by
+  // fade_position_rate_ every fade tick from there. Updated with each SWITCH and POLL.
+  uint16_t fade_position_{0};
+  uint16_t fade_position_rate_{0};
+  uint32_t fade_position_time_{0};
+  // Calibration configuration.
+  uint8_t calibration_steps_{20};
+  uint8_t calibration_samples_{3};
+  uint32_t calibration_interval_{1000};
+  uint32_t calibration_warmup_{20000};
+  // Standard deviation in W below which a step completes early, 0 always takes all samples.
+  float calibration_stability_threshold_{0};
+
+  // Calibration run state.
   bool calibrating_{false};
-  int8_t calibration_step_{0};
+  uint8_t calibration_step_{0};
   uint8_t calibration_measurement_cnt_{0};
-  std::array<float, 3> calibration_measurements_;
-  std::array<float, 20> calibration_data_;
-  uint32_t update_interval_original_{0};
+  uint32_t calibration_start_time_{0};
+  bool calibration_settling_{false};
+  bool calibration_poll_pending_{false};
+  float last_power_{NAN};
+  std::array<float, SHELLY_DIMMER_MAX_CALIBRATION_SAMPLES> calibration_measurements_;
+  // Power in W measured at each step of a calibration run.
+  std::array<float, SHELLY_DIMMER_MAX_CALIBRATION_STEPS> calibration_data_;
+  // Resulting curve in Q0.16, only the first calibration_size_ entries are used, 0 when uncalibrated.
+  std::array<uint16_t, SHELLY_DIMMER_MAX_CALIBRATION_STEPS> calibration_curve_;
+  uint8_t calibration_size_{0};
+  // Calibrated output brightness with min/max brightness applied, indexed by requested brightness step.
+  std::array<uint16_t, SHELLY_DIMMER_BRIGHTNESS_TABLE_SIZE> brightness_table_;
 
   ESPPreferenceObject rtc_;
 
   /// Convert relative brightness into a dimmer brightness value.
   uint16_t convert_brightness_(float brightness);
 
-  /// Sends the given brightness value.
+  /// Recomputes the brightness lookup table, interpolating the calibration data with a monotone spline.
+  void rebuild_brightness_table_();
+
+  /// Looks up the calibrated dimmer brightness value for a relative brightness.
+  uint16_t lookup_brightness_(float brightness) const;
+
+  /// Brightness the STM32 output is at while it is still fading towards brightness_, unknown once it arrived.
+  optional<uint16_t> fade_position_now_() const;
+
+  /// Sends the given brightness value, or stores it as the next target while a SWITCH is in flight.
   void send_brightness_(uint16_t brightness);
 
   /// Sends dimmer configuration.
   void send_settings_();
 
-  /// Performs a firmware upgrade.
-  bool upgrade_firmware_();
+  /// Sends the SETTINGS frame with the given fade rate.
+  void send_settings_frame_(uint16_t brightness, uint16_t fade_rate);
 
-  /// Sends a command and waits for an acknowledgement.
-  bool send_command_(uint8_t cmd, const uint8_t *payload, uint8_t len);
+  /// Prepares a firmware rendered transition between the given brightness values.
+  void begin_firmware_transition_(float start, float target, uint32_t length);
 
-  /// Frames a given command payload.
-  size_t frame_command_(uint8_t *data, uint8_t cmd, const uint8_t *payload, size_t len);
+  /// Reverts to the configured fade rate once a firmware rendered transition is over.
+  void end_firmware_transition_();
 
-  /// Handles a single byte as part of a protocol frame.
-  ///
-  /// Returns -1 on failure, 0 when finished and 1 when more bytes needed.
-  int handle_byte_(uint8_t c);
+  /// Sends settings and polls the current state, once the firmware is known to be good.
+  void complete_setup_();
+
+#ifdef USE_SHD_FIRMWARE_DATA
+  /// Starts a firmware upgrade, the rest of it is performed from loop().
+  void start_firmware_upgrade_();
+
+  /// Advances the firmware upgrade by a single step.
+  void process_firmware_upgrade_();
+
+  /// Checks the current flash page and schedules a rewrite when it does not match the image.
+  void compare_firmware_page_();
+
+  /// Moves on to verification, if enabled, or to booting the new firmware.
+  void finish_firmware_upgrade_phase_();
+
+  /// Aborts the firmware upgrade and marks the component failed.
+  void fail_firmware_upgrade_();
+
+  /// Publishes the firmware upgrade progress when it changed.
+  void publish_firmware_upgrade_progress_();
+#endif
+
+  /// Publishes the link statistics and starts a new latency window.
+  void publish_link_statistics_();
 
-  /// Reads a response frame.
-  bool read_frame_();
+  /// Handles the payload of a reply frame.
+  bool handle_frame_(uint8_t cmd, const uint8_t *payload, uint8_t payload_len);
 
-  /// Handles a complete frame.
-  bool handle_frame_();
+  /// Sends a sampling POLL when the sample interval has elapsed.
+  void sample_();
+
+  /// Adds a fast sampled measurement to the aggregates.
+  void accumulate_sample_(float power, float voltage, float current);
+
+  /// Publishes the aggregates of the last update interval.
+  void publish_samples_();
+
+  /// Publishes a POLL measurement unless the publish filter suppresses it.
+  void publish_measurement_(sensor::Sensor *sensor, MeasurementFilter &filter, uint32_t raw, float value);
 
   /// Reset STM32 with the BOOT0 pin set to the given value.
   void reset_(bool boot0);
 
+  /// Asks the STM32 for its firmware version, returns whether it answered.
+  ///
+  /// A warm probe is a single short attempt, the STM32 may not be running any firmware at all.
+  bool probe_version_(bool warm);
+
   /// Reset STM32 to boot the regular firmware.
   void reset_normal_boot_();
 
-  /// Reset STM32 to boot into DFU mode to enable firmware upgrades.
-  void reset_dfu_boot_();
+#ifdef USE_SHD_FIRMWARE_DATA
+  /// Reset STM32 to boot into DFU mode to enable firmware upgrades, using the given baud rate.
+  void reset_dfu_boot_(uint32_t baud_rate);
+#endif
+
+  /// Starts measuring at the given calibration step, on the calibration timer.
+  void begin_calibration_(uint8_t step);
+
+  /// Relative brightness measured at a calibration step.
+  float calibration_step_brightness_(uint8_t step) const;
+
+  /// Requests a calibration measurement, unless one is still outstanding.
+  void poll_calibration_();
 
   /// Perform calibration measurement.
   void perform_calibration_measurement_();
 
+  /// Mean of the measurements collected at the current step.
+  float calibration_mean_() const;
+
+  /// Whether the measurements at the current step are within the stability threshold.
+  bool calibration_stable_() const;
+
   /// Complete a single calibration step averaging over accumulated measurements.
   void complete_calibration_step_();
 
   /// Complete the whole calibration process.
   void complete_calibration_();
 
+  /// Loads calibration values from flash, migrating the fixed 20 step format.
+  void load_calibration_();
+
   /// Saves calibration values to flash.
   void save_calibration_();
 
+  /// Checksum of a stored calibration curve.
+  static uint16_t calibration_checksum_(const CalibrationData &data);
+
+  /// Continues a calibration run interrupted by a reboot, if there is one.
+  void resume_calibration_();
+
+  /// Saves the progress of the running calibration in place of the stored curve.
+  void save_calibration_checkpoint_();
+
   /// Set brightness with no transition during calibration.
   void set_brightness_no_transition_(float brightness);
+
+  friend class ShellyDimmerTransformer;
+};
+
+/// Transition that jumps straight to the target values and lets the STM32 firmware perform the fade.
+class ShellyDimmerTransformer : public light::LightTransformer {
+ public:
+  explicit ShellyDimmerTransformer(ShellyDimmer *parent) : parent_(parent) {}
+  ~ShellyDimmerTransformer() override { this->parent_->end_firmware_transition_(); }
+
+  optional<light::LightColorValues> apply() override;
+
+ protected:
+  ShellyDimmer *parent_;
+  bool applied_{false};
 };
 
 }  // namespace shelly_dimmer
 }  // namespace esphome
-
-#endif  // USE_ESP8266
@@ -30,6 +30,7 @@
 #include "esphome/core/log.h"
 
 #include <algorithm>
+#include <cstring>
 #include <memory>
 
 namespace {
@@ -110,6 +111,42 @@ constexpr uint32_t STM_OBL_LAUNCH_CODE_SIZE = sizeof(STM_OBL_LAUNCH_CODE);
 
 constexpr char TAG[] = "stm32flash";
 
+/* Lookup tables for the table driven CRC, see stm32_sw_crc(). */
+constexpr uint32_t CRCPOLY_BE = 0x04c11db7;
+constexpr uint32_t CRC_MSBMASK = 0x80000000;
+#ifdef USE_SHD_CRC_TABLE_4K
+constexpr size_t CRC_TABLE_COUNT = 4; /* slice-by-4, 4 KB */
+#else
+constexpr size_t CRC_TABLE_COUNT = 1; /* byte at a time, 1 KB */
+#endif
+
+struct CrcTables {
+  uint32_t table[CRC_TABLE_COUNT][256];
+};
+
+constexpr CrcTables make_crc_tables() {
+  CrcTables tables{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i << 24;
+    for (size_t bit = 0; bit < 8; ++bit) {
+      crc = (crc & CRC_MSBMASK) ? (crc << 1) ^ CRCPOLY_BE : (crc << 1);
+    }
+    tables.table[0][i] = crc;
+  }
+  /* table[n] advances a byte by another 8 bits compared to table[n - 1] */
+  for (size_t n = 1; n < CRC_TABLE_COUNT; ++n) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      const uint32_t prev = tables.table[n - 1][i];
+      tables.table[n][i] = (prev << 8) ^ tables.table[0][prev >> 24];
+    }
+  }
+  return tables;
+}
+
+constexpr CrcTables CRC_TABLES PROGMEM = make_crc_tables();
+
+inline uint32_t crc_table(size_t n, uint32_t index) { return pgm_read_dword(&CRC_TABLES.table[n][index]); }
+
 }  // Anonymous namespace
 
 namespace esphome {
@@ -474,6 +511,125 @@ template<size_t N> void populate_buffer_with_address(uint8_t (&buffer)[N], uint3
   buffer[4] = static_cast<uint8_t>(buffer[0] ^ buffer[1] ^ buffer[2] ^ buffer[3]);
 }
 
+/* stages of an incremental write, see stm32_write_poll() */
+constexpr uint8_t STM32_WRITE_COMMAND = 0;
+constexpr uint8_t STM32_WRITE_COMMAND_ACK = 1;
+constexpr uint8_t STM32_WRITE_ADDRESS_ACK = 2;
+constexpr uint8_t STM32_WRITE_DATA_ACK = 3;
+constexpr uint8_t STM32_WRITE_DONE = 4;
+
+constexpr uint32_t STM32_WRITE_CHUNK_SIZE = 256;
+
+/* common checks and setup of stm32_write_start() and stm32_write_start_progmem() */
+stm32_err_t stm32_write_init(const stm32_unique_ptr &stm, stm32_write_t &write, uint32_t address, uint32_t len) {
+  /* must be 32bit aligned */
+  if (address & 0x3) {
+    ESP_LOGD(TAG, "Error: WRITE address must be 4 byte aligned");
+    return STM32_ERR_UNKNOWN;
+  }
+
+  if (stm->cmd->wm == STM32_CMD_ERR) {
+    ESP_LOGD(TAG, "Error: WRITE command not implemented in bootloader.");
+    return STM32_ERR_NO_CMD;
+  }
+
+  write.address = address;
+  write.len = len;
+  write.offset = 0;
+  write.source = nullptr;
+  write.progmem = nullptr;
+  write.stage = STM32_WRITE_COMMAND;
+  write.current = 0;
+  if (len == 0) {
+    write.stage = STM32_WRITE_DONE;
+    return STM32_ERR_OK;
+  }
+  return STM32_ERR_PENDING;
+}
+
+uint32_t stm32_write_chunk_len(const stm32_write_t &write) {
+  return std::min(write.len - write.offset, STM32_WRITE_CHUNK_SIZE);
+}
+
+/* frame layout: length - 1, data padded to a multiple of 4 bytes, checksum */
+unsigned int stm32_frame_len(uint32_t n) { return ((n + 3) & ~3) + 2; }
+
+/* fetches and frames the chunk at offset into the given frame buffer */
+bool stm32_prepare_frame(stm32_write_t &write, uint8_t index, uint32_t offset) {
+  uint8_t *const frame = write.frames[index];
+  const uint32_t n = std::min(write.len - offset, STM32_WRITE_CHUNK_SIZE);
+  if (!write.source(offset, frame + 1, n))
+    return false;
+
+  const unsigned int aligned_len = (n + 3) & ~3;
+  std::memset(frame + 1 + n, 0xFF, aligned_len - n);
+
+  uint8_t cs = aligned_len - 1;
+  frame[0] = aligned_len - 1;
+  for (unsigned int i = 0; i < aligned_len; i++)
+    cs ^= frame[i + 1];
+  frame[aligned_len + 1] = cs;
+  return true;
+}
+
+/* streams a data frame word by word out of PROGMEM, computing the checksum on the fly */
+void stm32_write_progmem_frame(uart::UARTDevice *stream, const uint8_t *data, uint32_t n) {
+  /* flash can only be read a word at a time, unaligned data is read byte by byte */
+  const bool aligned = (reinterpret_cast<uintptr_t>(data) & 0x3) == 0;
+
+  const uint32_t aligned_len = (n + 3) & ~3;
+  uint8_t cs = aligned_len - 1;
+  stream->write_byte(aligned_len - 1);
+
+  const uint8_t *p = data;
+  for (uint32_t i = 0; i < aligned_len; i += 4, p += 4) {
+    uint8_t word[4];
+    if (aligned && i + 4 <= n) {
+      const uint32_t value = pgm_read_dword(p);
+      std::memcpy(word, &value, sizeof(word));
+    } else {
+      for (uint32_t j = 0; j < 4; j++)
+        word[j] = i + j < n ? pgm_read_byte(p + j) : 0xFF;
+    }
+    cs ^= word[0] ^ word[1] ^ word[2] ^ word[3];
+    stream->write_array(word, sizeof(word));
+  }
+  stream->write_byte(cs);
+}
+
+/* arms the ack timeout of an incremental write, see stm32_get_ack_timeout() */
+void stm32_expect_ack(const stm32_unique_ptr &stm, stm32_write_t &write, uint32_t timeout) {
+  if (!(stm->flags & STREAM_OPT_RETRY))
+    timeout = 0;
+
+  write.ack_start = millis();
+  write.ack_timeout = timeout == 0 ? DEFAULT_TIMEOUT : timeout;
+}
+
+/* non-blocking stm32_get_ack_timeout(), STM32_ERR_PENDING until a reply arrives */
+stm32_err_t stm32_poll_ack(const stm32_unique_ptr &stm, const stm32_write_t &write) {
+  auto *const stream = stm->stream;
+
+  while (stream->available()) {
+    uint8_t rxbyte;
+    stream->read_byte(&rxbyte);
+
+    if (rxbyte == STM32_ACK)
+      return STM32_ERR_OK;
+    if (rxbyte == STM32_NACK)
+      return STM32_ERR_NACK;
+    if (rxbyte != STM32_BUSY) {
+      ESP_LOGD(TAG, "Got byte 0x%02x instead of ACK", rxbyte);
+      return STM32_ERR_UNKNOWN;
+    }
+  }
+
+  if (millis() - write.ack_start < write.ack_timeout)
+    return STM32_ERR_PENDING;
+  ESP_LOGD(TAG, "Failed to read ACK timeout=%i", write.ack_timeout);
+  return STM32_ERR_UNKNOWN;
+}
+
 template<typename T> stm32_unique_ptr make_stm32_with_deletor(T ptr) {
   static const auto CLOSE = [](stm32_t *stm32) {
     if (stm32) {
@@ -644,7 +800,11 @@ stm32_unique_ptr stm32_init(uart::UARTDevice *stream, const uint8_t flags, const
     return make_stm32_with_deletor(nullptr);
   }
 
+#ifdef USE_SHD_DEVICE_IDS
+  stm->dev = SUPPORTED_DEVICES.data();
+#else
   stm->dev = DEVICES;
+#endif
   while (stm->dev->id != 0x00 && stm->dev->id != stm->pid)
     ++stm->dev;
 
@@ -756,6 +916,154 @@ stm32_err_t stm32_write_memory(const stm32_unique_ptr &stm, uint32_t address, co
   return STM32_ERR_OK;
 }
 
+/*
+ * Writes len bytes pulled from source, 256 bytes per write memory
+ * command. Two frame buffers are used: the next chunk is fetched and
+ * framed while the current one is still being transmitted and
+ * programmed, instead of leaving the UART idle in between.
+ */
+stm32_err_t stm32_write_stream(const stm32_unique_ptr &stm, uint32_t address, const stm32_source_t &source,
+                               uint32_t len) {
+  stm32_write_t write;
+  stm32_err_t s_err = stm32_write_start(stm, write, address, source, len);
+  while (s_err == STM32_ERR_PENDING) {
+    yield();
+    s_err = stm32_write_poll(stm, write);
+  }
+  return s_err;
+}
+
+/*
+ * Writes len bytes of PROGMEM data without any intermediate buffer: each
+ * 256 byte chunk is streamed word by word straight out of flash, the
+ * checksum is computed on the fly. Bytes past len are sent as padding and
+ * never read.
+ */
+stm32_err_t stm32_write_progmem(const stm32_unique_ptr &stm, uint32_t address, const uint8_t *data, uint32_t len) {
+  stm32_write_t write;
+  stm32_err_t s_err = stm32_write_start_progmem(stm, write, address, data, len);
+  while (s_err == STM32_ERR_PENDING) {
+    yield();
+    s_err = stm32_write_poll(stm, write);
+  }
+  return s_err;
+}
+
+/*
+ * Starts an incremental write of len bytes pulled from source, see
+ * stm32_write_stream(). Nothing waits for the device: every
+ * stm32_write_poll() call moves the write on as far as the acks that
+ * have arrived allow, so the caller can return to its main loop while
+ * the bootloader programs the flash.
+ */
+stm32_err_t stm32_write_start(const stm32_unique_ptr &stm, stm32_write_t &write, uint32_t address,
+                              const stm32_source_t &source, uint32_t len) {
+  const stm32_err_t s_err = stm32_write_init(stm, write, address, len);
+  if (s_err != STM32_ERR_PENDING)
+    return s_err;
+
+  write.source = source;
+  if (!stm32_prepare_frame(write, write.current, 0)) {
+    ESP_LOGD(TAG, "Error: failed to read data to write at offset 0x%08x", write.offset);
+    return STM32_ERR_UNKNOWN;
+  }
+  return stm32_write_poll(stm, write);
+}
+
+/* PROGMEM counterpart of stm32_write_start(), see stm32_write_progmem() */
+stm32_err_t stm32_write_start_progmem(const stm32_unique_ptr &stm, stm32_write_t &write, uint32_t address,
+                                      const uint8_t *data, uint32_t len) {
+  const stm32_err_t s_err = stm32_write_init(stm, write, address, len);
+  if (s_err != STM32_ERR_PENDING)
+    return s_err;
+
+  write.progmem = data;
+  return stm32_write_poll(stm, write);
+}
+
+/*
+ * Advances a write without blocking. Returns STM32_ERR_PENDING while an
+ * ack is outstanding and STM32_ERR_OK once all data has been written.
+ */
+stm32_err_t stm32_write_poll(const stm32_unique_ptr &stm, stm32_write_t &write) {
+  auto *const stream = stm->stream;
+
+  while (true) {
+    switch (write.stage) {
+      case STM32_WRITE_COMMAND: {
+        if (write.offset >= write.len) {
+          write.stage = STM32_WRITE_DONE;
+          return STM32_ERR_OK;
+        }
+
+        const uint8_t buf[] = {
+            stm->cmd->wm,
+            static_cast<uint8_t>(stm->cmd->wm ^ 0xFF),
+        };
+        stream->write_array(buf, sizeof(buf));
+        stm32_expect_ack(stm, write, 0);
+        write.stage = STM32_WRITE_COMMAND_ACK;
+        break;
+      }
+      case STM32_WRITE_COMMAND_ACK: {
+        const auto s_err = stm32_poll_ack(stm, write);
+        if (s_err == STM32_ERR_PENDING)
+          return s_err;
+        if (s_err != STM32_ERR_OK) {
+          ESP_LOGD(TAG, "Unexpected reply from device on command 0x%02x", stm->cmd->wm);
+          return STM32_ERR_UNKNOWN;
+        }
+
+        /* send the address and checksum */
+        static constexpr auto BUFFER_SIZE = 5;
+        uint8_t buf[BUFFER_SIZE];
+        populate_buffer_with_address(buf, write.address + write.offset);
+        stream->write_array(buf, BUFFER_SIZE);
+        stm32_expect_ack(stm, write, 0);
+        write.stage = STM32_WRITE_ADDRESS_ACK;
+        break;
+      }
+      case STM32_WRITE_ADDRESS_ACK: {
+        const auto s_err = stm32_poll_ack(stm, write);
+        if (s_err == STM32_ERR_PENDING)
+          return s_err;
+        if (s_err != STM32_ERR_OK)
+          return STM32_ERR_UNKNOWN;
+
+        const uint32_t n = stm32_write_chunk_len(write);
+        if (write.progmem != nullptr) {
+          stm32_write_progmem_frame(stream, write.progmem + write.offset, n);
+        } else {
+          /* queue the data, then prepare the next chunk while this one is on the wire */
+          stream->write_array(write.frames[write.current], stm32_frame_len(n));
+          const uint8_t next = write.current ^ 1;
+          if (write.offset + n < write.len && !stm32_prepare_frame(write, next, write.offset + n)) {
+            ESP_LOGD(TAG, "Error: failed to read data to write at offset 0x%08x", write.offset + n);
+            return STM32_ERR_UNKNOWN;
+          }
+        }
+        stm32_expect_ack(stm, write, STM32_BLKWRITE_TIMEOUT);
+        write.stage = STM32_WRITE_DATA_ACK;
+        break;
+      }
+      case STM32_WRITE_DATA_ACK: {
+        const auto s_err = stm32_poll_ack(stm, write);
+        if (s_err == STM32_ERR_PENDING)
+          return s_err;
+        if (s_err != STM32_ERR_OK)
+          return STM32_ERR_UNKNOWN;
+
+        write.offset += stm32_write_chunk_len(write);
+        write.current ^= 1;
+        write.stage = STM32_WRITE_COMMAND;
+        break;
+      }
+      default:
+        return STM32_ERR_OK;
+    }
+  }
+}
+
 stm32_err_t stm32_wunprot_memory(const stm32_unique_ptr &stm) {
   if (stm->cmd->uw == STM32_CMD_ERR) {
     ESP_LOGD(TAG, "Error: WRITE UNPROTECT command not implemented in bootloader.");
@@ -963,7 +1271,7 @@ stm32_err_t stm32_crc_memory(const stm32_unique_ptr &stm, const uint32_t address
   {
     static constexpr auto BUFFER_SIZE = 5;
     uint8_t buf[BUFFER_SIZE];
-    populate_buffer_with_address(buf, address);
+    populate_buffer_with_address(buf, length);
 
     stream->write_array(buf, BUFFER_SIZE);
     stream->flush();
@@ -995,12 +1303,12 @@ stm32_err_t stm32_crc_memory(const stm32_unique_ptr &stm, const uint32_t address
  * But STM32 computes it on units of 32 bits word and swaps the
  * bytes of the word before the computation.
  * Due to byte swap, I cannot use any CRC available in existing
- * libraries, so here is a simple not optimized implementation.
+ * libraries, so the tables are built here. The word is consumed
+ * most significant byte first, either one byte at a time from a
+ * single table or all four bytes at once with slice-by-4 when
+ * USE_SHD_CRC_TABLE_4K is defined.
  */
 uint32_t stm32_sw_crc(uint32_t crc, uint8_t *buf, unsigned int len) {
-  static constexpr uint32_t CRCPOLY_BE = 0x04c11db7;
-  static constexpr uint32_t CRC_MSBMASK = 0x80000000;
-
   if (len & 0x3) {
     ESP_LOGD(TAG, "Buffer length must be multiple of 4 bytes");
     return 0;
@@ -1015,13 +1323,14 @@ uint32_t stm32_sw_crc(uint32_t crc, uint8_t *buf, unsigned int len) {
 
     crc ^= data;
 
-    for (size_t i = 0; i < 32; ++i) {
-      if (crc & CRC_MSBMASK) {
-        crc = (crc << 1) ^ CRCPOLY_BE;
-      } else {
-        crc = (crc << 1);
-      }
+#ifdef USE_SHD_CRC_TABLE_4K
+    crc = crc_table(3, crc >> 24) ^ crc_table(2, (crc >> 16) & 0xFF) ^ crc_table(1, (crc >> 8) & 0xFF) ^
+          crc_table(0, crc & 0xFF);
+#else
+    for (size_t i = 0; i < 4; ++i) {
+      crc = (crc << 8) ^ crc_table(0, crc >> 24);
     }
+#endif
   }
   return crc;
 }
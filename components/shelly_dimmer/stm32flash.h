@@ -23,6 +23,7 @@
 #ifdef USE_SHD_FIRMWARE_DATA
 
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include "esphome/components/uart/uart.h"
 
@@ -51,6 +52,7 @@ using stm32_err_t = enum Stm32Err {
   STM32_ERR_UNKNOWN, /* Generic error */
   STM32_ERR_NACK,
   STM32_ERR_NO_CMD, /* Command not available in bootloader */
+  STM32_ERR_PENDING, /* Incremental operation still waiting for the device */
 };
 
 using flags_t = enum Flags {
@@ -111,9 +113,43 @@ struct VarlenCmd {
 
 using stm32_unique_ptr = std::unique_ptr<stm32_t, void (*)(stm32_t *)>;
 
+/*
+ * Data source for stm32_write_stream(): copies len bytes starting at
+ * offset (relative to the start of the stream) into buf.
+ * Returns false to abort the write.
+ */
+using stm32_source_t = std::function<bool(uint32_t offset, uint8_t *buf, unsigned int len)>;
+
+/*
+ * Progress of a write started with stm32_write_start() or
+ * stm32_write_start_progmem(), advanced by stm32_write_poll().
+ * Data comes either from a source, double buffered in frames, or
+ * straight out of PROGMEM.
+ */
+using stm32_write_t = struct Stm32Write {
+  uint32_t address;
+  uint32_t len;
+  uint32_t offset; /* bytes acknowledged so far */
+  stm32_source_t source;
+  const uint8_t *progmem;
+  uint8_t stage;
+  uint32_t ack_start;
+  uint32_t ack_timeout;
+  uint8_t current;
+  uint8_t frames[2][STM32_MAX_TX_FRAME];
+};
+
 stm32_unique_ptr stm32_init(uart::UARTDevice *stream, uint8_t flags, char init);
 stm32_err_t stm32_read_memory(const stm32_unique_ptr &stm, uint32_t address, uint8_t *data, unsigned int len);
 stm32_err_t stm32_write_memory(const stm32_unique_ptr &stm, uint32_t address, const uint8_t *data, unsigned int len);
+stm32_err_t stm32_write_stream(const stm32_unique_ptr &stm, uint32_t address, const stm32_source_t &source,
+                               uint32_t len);
+stm32_err_t stm32_write_progmem(const stm32_unique_ptr &stm, uint32_t address, const uint8_t *data, uint32_t len);
+stm32_err_t stm32_write_start(const stm32_unique_ptr &stm, stm32_write_t &write, uint32_t address,
+                              const stm32_source_t &source, uint32_t len);
+stm32_err_t stm32_write_start_progmem(const stm32_unique_ptr &stm, stm32_write_t &write, uint32_t address,
+                                      const uint8_t *data, uint32_t len);
+stm32_err_t stm32_write_poll(const stm32_unique_ptr &stm, stm32_write_t &write);
 stm32_err_t stm32_wunprot_memory(const stm32_unique_ptr &stm);
 stm32_err_t stm32_wprot_memory(const stm32_unique_ptr &stm);
 stm32_err_t stm32_erase_memory(const stm32_unique_ptr &stm, uint32_t spage, uint32_t pages);
@@ -0,0 +1,475 @@
+#include "transport.h"
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <numeric>
+
+namespace esphome {
+namespace shelly_dimmer {
+
+namespace {
+
+constexpr char TAG[] = "shelly_dimmer.transport";
+
+// Ack timeout used until the first round trip has been measured.
+constexpr uint16_t SHELLY_DIMMER_ACK_TIMEOUT = 200;  // ms
+constexpr uint8_t SHELLY_DIMMER_MAX_RETRIES = 3;
+// Limit for the backoff applied while the STM32 does not respond at all.
+constexpr uint8_t SHELLY_DIMMER_MAX_BACKOFF_SHIFT = 3;
+
+// Protocol framing.
+constexpr uint8_t SHELLY_DIMMER_PROTO_START_BYTE = 0x01;
+constexpr uint8_t SHELLY_DIMMER_PROTO_END_BYTE = 0x04;
+
+/// Bounds for the ack timeout of a command.
+struct CommandTimeoutProfile {
+  uint8_t cmd;
+  uint16_t min_timeout;  // ms
+  uint16_t max_timeout;  // ms
+};
+
+// SWITCH and POLL normally ack within a few ms, SETTINGS and VERSION (right after a reset) take longer.
+constexpr CommandTimeoutProfile COMMAND_TIMEOUT_PROFILES[] = {
+    {SHELLY_DIMMER_PROTO_CMD_SWITCH, 10, 400},
+    {SHELLY_DIMMER_PROTO_CMD_POLL, 10, 400},
+    {SHELLY_DIMMER_PROTO_CMD_SETTINGS, 50, 800},
+    {SHELLY_DIMMER_PROTO_CMD_VERSION, 200, 1000},
+};
+constexpr CommandTimeoutProfile DEFAULT_TIMEOUT_PROFILE = {0, 50, 800};
+
+// Upper limits (inclusive, in ms) of the ack latency histogram buckets, the last bucket takes everything above.
+constexpr uint16_t LATENCY_BUCKET_LIMITS[] = {1, 2, 5, 10, 20, 50, 100, 200, 500};
+
+const CommandTimeoutProfile &command_timeout_profile(uint8_t cmd) {
+  for (const CommandTimeoutProfile &profile : COMMAND_TIMEOUT_PROFILES) {
+    if (profile.cmd == cmd) {
+      return profile;
+    }
+  }
+  return DEFAULT_TIMEOUT_PROFILE;
+}
+
+#if ESPHOME_LOG_LEVEL >= ESPHOME_LOG_LEVEL_DEBUG
+/// Formats data as hex into out, which must hold 2 * len + 1 characters. Unlike format_hex() it does not allocate.
+const char *hex_to(char *out, const uint8_t *data, size_t len) {
+  constexpr char DIGITS[] = "0123456789abcdef";
+  for (size_t i = 0; i < len; i++) {
+    out[2 * i] = DIGITS[data[i] >> 4];
+    out[2 * i + 1] = DIGITS[data[i] & 0x0F];
+  }
+  out[2 * len] = '\0';
+  return out;
+}
+#endif
+
+}  // namespace
+
+/// Computes a crappy checksum as defined by the Shelly Dimmer protocol.
+uint16_t shelly_dimmer_checksum(const uint8_t *buf, int len) {
+  return std::accumulate<decltype(buf), uint16_t>(buf, buf + len, 0);
+}
+
+std::vector<ShellyTransport *> &ShellyTransport::links() {
+  static std::vector<ShellyTransport *> links;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+  return links;
+}
+
+ShellyTransport::ShellyTransport(uart::UARTDevice *uart, FrameHandler frame_handler)
+    : uart_(uart), frame_handler_(std::move(frame_handler)) {
+  links().push_back(this);
+}
+
+ShellyTransport::~ShellyTransport() {
+  std::vector<ShellyTransport *> &all = links();
+  all.erase(std::remove(all.begin(), all.end(), this), all.end());
+}
+
+bool ShellyTransport::send_command(uint8_t cmd, const uint8_t *const payload, uint8_t len, CommandCallback callback) {
+  return this->enqueue_(cmd, payload, len, std::move(callback), false, 0);
+}
+
+bool ShellyTransport::send_probe(uint8_t cmd, uint16_t timeout, CommandCallback callback) {
+  return this->enqueue_(cmd, nullptr, 0, std::move(callback), true, timeout);
+}
+
+bool ShellyTransport::enqueue_(uint8_t cmd, const uint8_t *const payload, uint8_t len, CommandCallback callback,
+                               bool probe, uint16_t probe_timeout) {
+  if (this->queue_size_ >= SHELLY_DIMMER_MAX_QUEUED_COMMANDS) {
+    ESP_LOGW(TAG, "Command queue full, dropping command 0x%02x", cmd);
+    return false;
+  }
+  if (len > SHELLY_DIMMER_MAX_PAYLOAD_SIZE) {
+    ESP_LOGW(TAG, "Command 0x%02x payload too large (%d bytes)", cmd, len);
+    return false;
+  }
+
+  Command &command = this->command_queue_[(this->queue_head_ + this->queue_size_) % SHELLY_DIMMER_MAX_QUEUED_COMMANDS];
+  command.cmd = cmd;
+  command.len = len;
+  if (payload != nullptr) {
+    std::memcpy(command.payload.data(), payload, len);
+  }
+  command.callback = std::move(callback);
+  command.batch = this->batch_depth_ != 0 ? this->batch_id_ : 0;
+  command.probe = probe;
+  command.probe_timeout = probe_timeout;
+  this->queue_size_++;
+
+  // Start right away if there is room in the pending table, batches start once complete.
+  if (this->batch_depth_ == 0) {
+    this->start_commands_();
+  }
+  return true;
+}
+
+void ShellyTransport::begin_batch() {
+  if (this->batch_depth_++ == 0) {
+    // 0 marks commands outside of a batch.
+    if (++this->batch_id_ == 0) {
+      this->batch_id_ = 1;
+    }
+  }
+}
+
+void ShellyTransport::end_batch() {
+  if (this->batch_depth_ != 0 && --this->batch_depth_ == 0) {
+    this->start_commands_();
+  }
+}
+
+bool ShellyTransport::commands_in_flight() const {
+  return std::any_of(this->pending_commands_.begin(), this->pending_commands_.end(),
+                     [](const PendingCommand &pending) { return pending.active; });
+}
+
+bool ShellyTransport::can_transmit_(const Command &command) const {
+  bool free_slot = false;
+  for (const PendingCommand &pending : this->pending_commands_) {
+    if (!pending.active) {
+      free_slot = true;
+      continue;
+    }
+    // Replies of the same command are indistinguishable apart from their sequence number, keep them in order.
+    if (pending.command.cmd == command.cmd) {
+      return false;
+    }
+    // SETTINGS must be applied before whatever follows (e.g. the fade rate for the next SWITCH), so it goes alone.
+    // Within a batch the frames are written in order and the STM32 processes them in order, so they may overlap.
+    const bool same_batch = command.batch != 0 && pending.command.batch == command.batch;
+    if (!same_batch &&
+        (pending.command.cmd == SHELLY_DIMMER_PROTO_CMD_SETTINGS || command.cmd == SHELLY_DIMMER_PROTO_CMD_SETTINGS)) {
+      return false;
+    }
+  }
+  return free_slot;
+}
+
+void ShellyTransport::start_commands_() {
+  // Strictly in queue order, a command that has to wait holds back everything behind it.
+  bool sent = false;
+  while (this->queue_size_ != 0 && this->can_transmit_(this->command_queue_[this->queue_head_])) {
+    this->transmit_command_();
+    sent = true;
+  }
+  // Frames started together go out back to back.
+  if (sent) {
+    this->uart_->flush();
+  }
+}
+
+void ShellyTransport::transmit_command_() {
+  auto pending = std::find_if(this->pending_commands_.begin(), this->pending_commands_.end(),
+                              [](const PendingCommand &slot) { return !slot.active; });
+  Command &front = this->command_queue_[this->queue_head_];
+  pending->command = std::move(front);
+  front.callback = nullptr;
+  this->queue_head_ = (this->queue_head_ + 1) % SHELLY_DIMMER_MAX_QUEUED_COMMANDS;
+  this->queue_size_--;
+
+  const Command &command = pending->command;
+#if ESPHOME_LOG_LEVEL >= ESPHOME_LOG_LEVEL_DEBUG
+  char hex[SHELLY_DIMMER_MAX_PAYLOAD_SIZE * 2 + 1];
+  ESP_LOGD(TAG, "Sending command: 0x%02x (%d bytes) payload 0x%s", command.cmd, command.len,
+           hex_to(hex, command.payload.data(), command.len));
+#endif
+
+  // Prepare a command frame, its sequence number identifies the reply.
+  pending->frame_len = this->frame_command_(pending->frame.data(), command.cmd, command.payload.data(), command.len);
+  pending->seq = pending->frame[1];
+  pending->attempts = 0;
+  pending->timeout = command.probe ? command.probe_timeout : this->command_timeout_(command.cmd);
+  pending->active = true;
+  this->write_tx_frame_(*pending);
+}
+
+void ShellyTransport::write_tx_frame_(PendingCommand &pending) {
+  this->uart_->write_array(pending.frame.data(), pending.frame_len);
+
+  this->link_stats_.frames_sent++;
+  if (pending.attempts != 0) {
+    this->link_stats_.retries++;
+  }
+
+  ESP_LOGV(TAG, "Command sent (seq %d), waiting for reply", pending.seq);
+  pending.tx_time = millis();
+  pending.attempts++;
+}
+
+ShellyTransport::PendingCommand *ShellyTransport::find_pending_(uint8_t seq, uint8_t cmd) {
+  for (PendingCommand &pending : this->pending_commands_) {
+    if (pending.active && pending.seq == seq && pending.command.cmd == cmd) {
+      return &pending;
+    }
+  }
+  return nullptr;
+}
+
+uint16_t ShellyTransport::command_timeout_(uint8_t cmd) const {
+  const CommandTimeoutProfile &profile = command_timeout_profile(cmd);
+
+  uint32_t timeout = SHELLY_DIMMER_ACK_TIMEOUT;
+  if (this->rtt_smoothed_ != 0) {
+    // RTO = SRTT + 4 * RTTVAR, see RFC 6298.
+    timeout = (this->rtt_smoothed_ >> 3) + this->rtt_variation_;
+  }
+  timeout <<= this->backoff_shift_;
+  return std::clamp<uint32_t>(timeout, profile.min_timeout, profile.max_timeout);
+}
+
+void ShellyTransport::update_rtt_(uint32_t rtt) {
+  // Jacobson/Karels estimator with the smoothed RTT scaled by 8 and the variation scaled by 4.
+  if (this->rtt_smoothed_ == 0) {
+    this->rtt_smoothed_ = std::max<uint32_t>(rtt, 1) << 3;
+    this->rtt_variation_ = rtt << 1;
+    return;
+  }
+
+  const int32_t error = static_cast<int32_t>(rtt) - static_cast<int32_t>(this->rtt_smoothed_ >> 3);
+  this->rtt_smoothed_ = std::max<int32_t>(static_cast<int32_t>(this->rtt_smoothed_) + error, 8);
+  this->rtt_variation_ += std::abs(error) - static_cast<int32_t>(this->rtt_variation_ >> 2);
+}
+
+void ShellyTransport::complete_command_(PendingCommand &pending, bool success) {
+  if (success) {
+    // Karn's algorithm: only replies to frames sent once are unambiguous samples.
+    if (pending.attempts == 1) {
+      const uint32_t rtt = millis() - pending.tx_time;
+      this->update_rtt_(rtt);
+      this->record_ack_latency_(rtt);
+    }
+    this->backoff_shift_ = 0;
+  }
+
+  // Free the slot before notifying so that the callback is free to queue follow-up commands.
+  CommandCallback callback = std::move(pending.command.callback);
+  pending.command.callback = nullptr;
+  pending.active = false;
+
+  if (callback) {
+    callback(success);
+  }
+}
+
+void ShellyTransport::process_command_queue_() {
+  const uint32_t now = millis();
+  for (PendingCommand &pending : this->pending_commands_) {
+    if (!pending.active || now - pending.tx_time < pending.timeout) {
+      continue;
+    }
+
+    ESP_LOGW(TAG, "Timeout while waiting for reply (seq %d, %d ms)", pending.seq, pending.timeout);
+    this->link_stats_.timeouts++;
+    if (!pending.command.probe && pending.attempts < SHELLY_DIMMER_MAX_RETRIES) {
+      // Exponential backoff between retries.
+      const CommandTimeoutProfile &profile = command_timeout_profile(pending.command.cmd);
+      pending.timeout = std::min<uint32_t>(pending.timeout * 2, profile.max_timeout);
+      this->write_tx_frame_(pending);
+      this->uart_->flush();
+      continue;
+    }
+
+    ESP_LOGW(TAG, "Failed to send command");
+    // The STM32 seems unresponsive, start the next commands with longer timeouts. An unanswered probe is expected.
+    if (!pending.command.probe) {
+      this->backoff_shift_ = std::min<uint8_t>(this->backoff_shift_ + 1, SHELLY_DIMMER_MAX_BACKOFF_SHIFT);
+    }
+    this->complete_command_(pending, false);
+  }
+
+  this->start_commands_();
+}
+
+void ShellyTransport::loop() {
+  this->read_frame_();
+  this->process_command_queue_();
+}
+
+void ShellyTransport::flush() {
+  while (this->commands_in_flight() || this->queue_size_ != 0) {
+    // Keep the other links going as well, so a blocking wait on one dimmer doesn't stall the others. Idle links are
+    // left alone, their UART may belong to the STM32 bootloader.
+    for (ShellyTransport *link : links()) {
+      if (link == this || link->commands_in_flight() || link->queue_size_ != 0) {
+        link->loop();
+      }
+    }
+    delay(1);
+  }
+}
+
+uint32_t ShellyTransport::schedule_offset(uint32_t interval) const {
+  const std::vector<ShellyTransport *> &all = links();
+  const auto index = std::find(all.begin(), all.end(), this) - all.begin();
+  return interval * index / all.size();
+}
+
+size_t ShellyTransport::frame_command_(uint8_t *data, uint8_t cmd, const uint8_t *const payload, size_t len) {
+  size_t pos = 0;
+
+  // Generate a frame.
+  data[0] = SHELLY_DIMMER_PROTO_START_BYTE;
+  data[1] = ++this->seq_;
+  data[2] = cmd;
+  data[3] = len;
+  pos += 4;
+
+  if (payload != nullptr) {
+    std::memcpy(data + 4, payload, len);
+    pos += len;
+  }
+
+  // Calculate checksum for the payload.
+  const uint16_t csum = shelly_dimmer_checksum(data + 1, 3 + len);
+  data[pos++] = static_cast<uint8_t>(csum >> 8);
+  data[pos++] = static_cast<uint8_t>(csum & 0xff);
+  data[pos++] = SHELLY_DIMMER_PROTO_END_BYTE;
+  return pos;
+}
+
+int ShellyTransport::handle_byte_(uint8_t c) {
+  const uint8_t pos = this->buffer_pos_;
+
+  if (pos == 0) {
+    // Must be start byte.
+    return c == SHELLY_DIMMER_PROTO_START_BYTE ? 1 : -1;
+  } else if (pos < 4) {
+    // Header.
+    return 1;
+  }
+
+  // Decode payload length from header.
+  const uint8_t payload_len = this->buffer_[3];
+  if ((4 + payload_len + 3) > SHELLY_DIMMER_BUFFER_SIZE) {
+    this->link_stats_.framing_errors++;
+    return -1;
+  }
+
+  if (pos < 4 + payload_len + 1) {
+    // Payload.
+    return 1;
+  }
+
+  if (pos == 4 + payload_len + 1) {
+    // Verify checksum.
+    const uint16_t csum = (this->buffer_[pos - 1] << 8 | c);
+    const uint16_t csum_verify = shelly_dimmer_checksum(&this->buffer_[1], 3 + payload_len);
+    if (csum != csum_verify) {
+      this->link_stats_.checksum_errors++;
+      return -1;
+    }
+    return 1;
+  }
+
+  if (pos == 4 + payload_len + 2) {
+    // Must be end byte.
+    if (c == SHELLY_DIMMER_PROTO_END_BYTE) {
+      return 0;
+    }
+  }
+  this->link_stats_.framing_errors++;
+  return -1;
+}
+
+bool ShellyTransport::read_frame_() {
+  bool received = false;
+  // Drain everything the UART has buffered, there may be more than one frame waiting.
+  while (this->uart_->available()) {
+    const uint8_t c = this->uart_->read();
+    this->buffer_[this->buffer_pos_] = c;
+
+    ESP_LOGVV(TAG, "Read byte: 0x%02x (pos %d)", c, this->buffer_pos_);
+
+    switch (this->handle_byte_(c)) {
+      case 0: {
+        // Frame successfully received.
+        this->dispatch_frame_();
+        this->buffer_pos_ = 0;
+        received = true;
+        break;
+      }
+      case -1: {
+        // Failure.
+        this->buffer_pos_ = 0;
+        break;
+      }
+      case 1: {
+        // Need more data.
+        this->buffer_pos_++;
+        break;
+      }
+    }
+  }
+  return received;
+}
+
+void ShellyTransport::dispatch_frame_() {
+  const uint8_t seq = this->buffer_[1];
+  const uint8_t cmd = this->buffer_[2];
+
+  // The payload is used either way, e.g. POLL data is worth publishing even when it arrives late.
+  const bool handled = this->frame_handler_ && this->frame_handler_(cmd, &this->buffer_[4], this->buffer_[3]);
+
+  // A frame acknowledges the command in flight with the same sequence number and command.
+  PendingCommand *pending = this->find_pending_(seq, cmd);
+  if (pending != nullptr) {
+    this->complete_command_(*pending, handled);
+  } else {
+    ESP_LOGV(TAG, "Unsolicited frame: 0x%02x (seq %d)", cmd, seq);
+    this->link_stats_.sequence_mismatches++;
+  }
+}
+
+void ShellyTransport::record_ack_latency_(uint32_t latency) {
+  static_assert(std::size(LATENCY_BUCKET_LIMITS) + 1 == SHELLY_DIMMER_LATENCY_BUCKETS, "Invalid bucket count");
+
+  LinkStats &stats = this->link_stats_;
+  stats.latency_min = stats.latency_count == 0 ? latency : std::min(stats.latency_min, latency);
+  stats.latency_max = std::max(stats.latency_max, latency);
+  stats.latency_sum += latency;
+  stats.latency_count++;
+
+  const auto *bucket = std::lower_bound(std::begin(LATENCY_BUCKET_LIMITS), std::end(LATENCY_BUCKET_LIMITS), latency);
+  stats.latency_histogram[bucket - std::begin(LATENCY_BUCKET_LIMITS)]++;
+}
+
+uint32_t ShellyTransport::ack_latency_percentile(uint8_t percent) const {
+  const LinkStats &stats = this->link_stats_;
+  // Rank of the sample at the given percentile, rounded up.
+  const uint32_t rank = (stats.latency_count * percent + 99) / 100;
+
+  uint32_t seen = 0;
+  for (size_t i = 0; i < std::size(LATENCY_BUCKET_LIMITS); i++) {
+    seen += stats.latency_histogram[i];
+    if (seen >= rank) {
+      return std::min<uint32_t>(LATENCY_BUCKET_LIMITS[i], stats.latency_max);
+    }
+  }
+  return stats.latency_max;
+}
+
+}  // namespace shelly_dimmer
+}  // namespace esphome
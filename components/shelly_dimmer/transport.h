@@ -0,0 +1,200 @@
+#pragma once
+
+#include "esphome/components/uart/uart.h"
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace esphome {
+namespace shelly_dimmer {
+
+// Supported commands.
+constexpr uint8_t SHELLY_DIMMER_PROTO_CMD_SWITCH = 0x01;
+constexpr uint8_t SHELLY_DIMMER_PROTO_CMD_POLL = 0x10;
+constexpr uint8_t SHELLY_DIMMER_PROTO_CMD_VERSION = 0x11;
+constexpr uint8_t SHELLY_DIMMER_PROTO_CMD_SETTINGS = 0x20;
+
+/// Computes a crappy checksum as defined by the Shelly Dimmer protocol.
+uint16_t shelly_dimmer_checksum(const uint8_t *buf, int len);
+
+/// Framed command transport to the application firmware of a single STM32, independent of the light output.
+///
+/// Every link has its own frame parser, command queue and RTT estimate. All links are driven from loop(), the
+/// blocking flush() keeps servicing the other links while it waits.
+class ShellyTransport {
+ public:
+  static constexpr uint8_t SHELLY_DIMMER_MAX_PAYLOAD_SIZE = 16;
+  // Ack latency histogram buckets, see LATENCY_BUCKET_LIMITS.
+  static constexpr uint8_t SHELLY_DIMMER_LATENCY_BUCKETS = 10;
+
+  /// Called once a command has been acknowledged (true) or has run out of retries (false).
+  using CommandCallback = std::function<void(bool success)>;
+
+  /// Handles the payload of a received frame, returns whether it is a valid reply to the command.
+  using FrameHandler = std::function<bool(uint8_t cmd, const uint8_t *payload, uint8_t len)>;
+
+  /// Counters describing the health of the UART link to the STM32.
+  struct LinkStats {
+    uint32_t frames_sent;
+    uint32_t retries;
+    uint32_t timeouts;
+    uint32_t checksum_errors;
+    uint32_t framing_errors;
+    uint32_t sequence_mismatches;
+    // Ack latency since the last publish, in ms.
+    uint32_t latency_count;
+    uint32_t latency_sum;
+    uint32_t latency_min;
+    uint32_t latency_max;
+    std::array<uint32_t, SHELLY_DIMMER_LATENCY_BUCKETS> latency_histogram;
+  };
+
+  ShellyTransport(uart::UARTDevice *uart, FrameHandler frame_handler);
+  ~ShellyTransport();
+  ShellyTransport(const ShellyTransport &) = delete;
+  ShellyTransport &operator=(const ShellyTransport &) = delete;
+
+  /// Queues a command, the callback is invoked once it completes.
+  ///
+  /// Returns false when the queue is full and the command was dropped.
+  bool send_command(uint8_t cmd, const uint8_t *payload, uint8_t len, CommandCallback callback = nullptr);
+
+  /// Queues a single attempt of a command with a fixed ack timeout: no retries and no backoff when it goes unanswered.
+  bool send_probe(uint8_t cmd, uint16_t timeout, CommandCallback callback);
+
+  /// Starts a batch: commands are only queued until the matching end_batch().
+  void begin_batch();
+
+  /// Ends a batch, transmitting its commands back to back in a single UART write burst.
+  void end_batch();
+
+  /// Whether any command is awaiting its reply.
+  bool commands_in_flight() const;
+
+  /// Reads replies and advances the command queue, non-blocking.
+  void loop();
+
+  /// Blocks until all queued commands have completed. Only meant to be used during setup.
+  void flush();
+
+  /// Offset into a polling interval that spreads the polls of all links evenly across it.
+  uint32_t schedule_offset(uint32_t interval) const;
+
+  LinkStats &stats() { return this->link_stats_; }
+
+  /// Returns the upper bound of the given ack latency percentile from the histogram.
+  uint32_t ack_latency_percentile(uint8_t percent) const;
+
+ protected:
+  static constexpr uint16_t SHELLY_DIMMER_BUFFER_SIZE = 256;
+  static constexpr uint8_t SHELLY_DIMMER_MAX_FRAME_SIZE = 4 + SHELLY_DIMMER_MAX_PAYLOAD_SIZE + 3;
+  // Commands awaiting their reply at the same time, e.g. a POLL and a SWITCH, or a whole batch.
+  static constexpr uint8_t SHELLY_DIMMER_MAX_IN_FLIGHT = 4;
+  static constexpr uint8_t SHELLY_DIMMER_MAX_QUEUED_COMMANDS = 8;
+
+  /// A command waiting in the outbound queue.
+  struct Command {
+    uint8_t cmd;
+    std::array<uint8_t, SHELLY_DIMMER_MAX_PAYLOAD_SIZE> payload;
+    uint8_t len;
+    CommandCallback callback;
+    // Batch the command was queued in, 0 if none.
+    uint8_t batch;
+    // Probes are sent once with a fixed timeout, otherwise the timeout is derived from the RTT estimate.
+    bool probe;
+    uint16_t probe_timeout;
+  };
+
+  /// A transmitted command awaiting its reply, matched by sequence number.
+  struct PendingCommand {
+    Command command;
+    bool active;
+    uint8_t seq;
+    uint8_t attempts;
+    uint32_t tx_time;
+    uint16_t timeout;
+    std::array<uint8_t, SHELLY_DIMMER_MAX_FRAME_SIZE> frame;
+    uint8_t frame_len;
+  };
+
+  /// All existing links, in creation order.
+  static std::vector<ShellyTransport *> &links();
+
+  uart::UARTDevice *uart_;
+  FrameHandler frame_handler_;
+
+  // Frame parser state.
+  uint8_t seq_{0};
+  std::array<uint8_t, SHELLY_DIMMER_BUFFER_SIZE> buffer_;
+  uint8_t buffer_pos_{0};
+
+  // Command transport state: commands waiting to be sent (a ring buffer, oldest at queue_head_) and the ones in flight.
+  std::array<Command, SHELLY_DIMMER_MAX_QUEUED_COMMANDS> command_queue_{};
+  uint8_t queue_head_{0};
+  uint8_t queue_size_{0};
+  std::array<PendingCommand, SHELLY_DIMMER_MAX_IN_FLIGHT> pending_commands_{};
+  // Ack latency estimate in ms: smoothed round trip time scaled by 8 (0 until measured), variation scaled by 4.
+  uint32_t rtt_smoothed_{0};
+  uint32_t rtt_variation_{0};
+  // Initial timeouts are multiplied by 2^backoff_shift_ after commands ran out of retries.
+  uint8_t backoff_shift_{0};
+  // Nesting depth of begin_batch() and the id of the open batch.
+  uint8_t batch_depth_{0};
+  uint8_t batch_id_{0};
+  LinkStats link_stats_{};
+
+  /// Adds a command to the queue, returns false when it was dropped.
+  bool enqueue_(uint8_t cmd, const uint8_t *payload, uint8_t len, CommandCallback callback, bool probe,
+                uint16_t probe_timeout);
+
+  /// Whether the given command may be transmitted alongside the ones already in flight.
+  bool can_transmit_(const Command &command) const;
+
+  /// Transmits queued commands for as long as the pending table allows.
+  void start_commands_();
+
+  /// Moves the command at the front of the queue into a free pending slot, frames and transmits it.
+  void transmit_command_();
+
+  /// (Re)writes the frame of a pending command to the UART, the caller flushes.
+  void write_tx_frame_(PendingCommand &pending);
+
+  /// Computes the initial ack timeout for a command from the RTT estimate and its timeout profile.
+  uint16_t command_timeout_(uint8_t cmd) const;
+
+  /// Feeds an observed ack latency into the RTT estimate.
+  void update_rtt_(uint32_t rtt);
+
+  /// Adds an ack latency sample to the link statistics.
+  void record_ack_latency_(uint32_t latency);
+
+  /// Looks up the pending command a reply belongs to, nullptr if there is none.
+  PendingCommand *find_pending_(uint8_t seq, uint8_t cmd);
+
+  /// Frees the pending slot and notifies the command's callback.
+  void complete_command_(PendingCommand &pending, bool success);
+
+  /// Advances the command queue: handles timeouts, retries and starts the next commands.
+  void process_command_queue_();
+
+  /// Frames a given command payload.
+  size_t frame_command_(uint8_t *data, uint8_t cmd, const uint8_t *payload, size_t len);
+
+  /// Handles a single byte as part of a protocol frame.
+  ///
+  /// Returns -1 on failure, 0 when finished and 1 when more bytes needed.
+  int handle_byte_(uint8_t c);
+
+  /// Reads all pending bytes, dispatching every complete frame.
+  ///
+  /// Returns true when at least one frame was received.
+  bool read_frame_();
+
+  /// Processes a complete frame and matches it against the command in flight.
+  void dispatch_frame_();
+};
+
+}  // namespace shelly_dimmer
+}  // namespace esphome